@@ -4,91 +4,1046 @@ Thread safe, templated, blocking queue.
 Copyright 2021. Andrew Wang.
 */
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory_resource>
 #include <mutex>
+#include <optional>
 #include <queue>
+#include <stdexcept>
 #include <utility>
+#include <vector>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+// C++20 coroutines, which enable async_pop and async_push.
+#include <coroutine>
+#define BLOCKING_QUEUE_COROUTINES 1
+#endif
+
+#include "queue_listener.h"
+#include "wait_policy.h"
 
 /**
  * Thread safe, templated, blocking queue.
+ * @tparam T The element type.
+ * @tparam WaitPolicy How threads wait before parking, as in wait_policy.h.
+ * @tparam Storage The FIFO container holding the elements, with the
+ *                 interface of std::queue, such as segmented_queue.
  */
-template <typename T>
+template <typename T, typename WaitPolicy = block_wait,
+          typename Storage = std::queue<T>>
 class blocking_queue {
  private:
   // Internal queue.
-  std::queue<T> m_queue;
+  Storage m_queue;
+
+  // Maximum number of elements held at once.
+  const size_t m_capacity;
+
+  // Size of m_queue, written under m_mutex and read without it.
+  std::atomic<size_t> m_size = 0;
+
+  // Whether close has been called, written under m_mutex.
+  std::atomic<bool> m_closed = false;
 
   // Synchronization primitives.
   std::mutex m_mutex;
-  std::condition_variable m_cv;
+  std::condition_variable m_not_empty;
+  std::condition_variable m_not_full;
+
+  // Threads blocked on each condition variable.
+  waiters m_consumers;
+  waiters m_producers;
+
+  // Wakeups claimed by serve_awaiters for threads that can use the
+  // elements and space it handed over, guarded by m_mutex.
+  size_t m_served_consumers = 0;
+  size_t m_served_producers = 0;
+
+  // Subscribed listeners with their keys, guarded by m_mutex.
+  std::vector<std::pair<queue_listener*, size_t>> m_listeners;
+
+#if defined(BLOCKING_QUEUE_COROUTINES)
+  // Coroutine suspended in async_pop or async_push.
+  struct awaiter {
+    awaiter* next = nullptr;
+    std::coroutine_handle<> handle;
+    void* executor = nullptr;
+    void (*schedule)(void* executor, std::coroutine_handle<> handle) = nullptr;
+    // Element popped for, or to be pushed by, the coroutine.
+    std::optional<T> elem;
+    // Whether the element of async_push was enqueued.
+    bool pushed = false;
+  };
+
+  // FIFO of suspended coroutines linked through awaiter::next.
+  struct awaiter_list {
+    awaiter* head = nullptr;
+    awaiter* tail = nullptr;
+
+    bool empty() const { return head == nullptr; }
+
+    void push(awaiter* node) {
+      node->next = nullptr;
+      (tail ? tail->next : head) = node;
+      tail = node;
+    }
+
+    awaiter* pop() {
+      auto* node = head;
+      head = node->next;
+      if (!head) tail = nullptr;
+      return node;
+    }
+  };
+
+  // Coroutines waiting for an element and for space, guarded by m_mutex.
+  awaiter_list m_pop_awaiters;
+  awaiter_list m_push_awaiters;
+
+  /**
+   * Schedules a resumed coroutine on an executor of type Executor.
+   * @param executor The executor.
+   * @param handle The coroutine to resume.
+   */
+  template <typename Executor>
+  static void schedule_on(void* executor, std::coroutine_handle<> handle);
+#endif
+
+  /**
+   * Notifies every subscribed listener. The caller must hold m_mutex.
+   */
+  void notify_listeners();
+
+  /**
+   * Constructs an element at the back of the storage, which passes its
+   * allocator to allocator-aware elements, and notifies the listeners if
+   * the queue was empty. The caller must hold m_mutex.
+   * @param args The arguments forwarded to the constructor of T.
+   */
+  template <typename... Args>
+  void store(Args&&... args);
+
+  /**
+   * Removes the front element.
+   * The caller must hold m_mutex and the queue must be non-empty.
+   * @returns The removed element.
+   */
+  T take();
+
+  /**
+   * Hands elements and space to suspended coroutines that can proceed,
+   * and schedules them on their executors. Claims wakeups for blocked
+   * threads that can use an element moved in for a coroutine or the
+   * space left by one taken out, which unlock_and_notify delivers.
+   * The caller must hold m_mutex.
+   */
+  void serve_awaiters();
+
+  /**
+   * Constructs an element at the back, then serves suspended coroutines.
+   * The caller must hold m_mutex.
+   * @param args The arguments forwarded to the constructor of T.
+   */
+  template <typename... Args>
+  void enqueue(Args&&... args);
+
+  /**
+   * Constructs an element in the queue only if it is not full or closed.
+   * @param args The arguments forwarded to the constructor of T.
+   * @returns Whether the element was enqueued.
+   */
+  template <typename... Args>
+  bool try_emplace(Args&&... args);
+
+  /**
+   * Constructs an element in the queue, blocking until at most deadline.
+   * @param deadline The latest time to wait for space.
+   * @param args The arguments forwarded to the constructor of T.
+   * @returns Whether the element was enqueued.
+   */
+  template <typename Clock, typename Duration, typename... Args>
+  bool emplace_until(const std::chrono::time_point<Clock, Duration>& deadline,
+                     Args&&... args);
+
+  /**
+   * Removes the front element, then serves suspended coroutines.
+   * The caller must hold m_mutex and the queue must be non-empty.
+   * @returns The removed element.
+   */
+  T dequeue();
+
+  /**
+   * Waits according to WaitPolicy until ready returns true. Parks on cv
+   * if needed, counting the calling thread in waiting so that signalers
+   * can skip notifying nobody.
+   * @param lock The held lock on m_mutex.
+   * @param cv The condition variable to block on.
+   * @param waiting The threads blocked on cv.
+   * @param ready Returns whether the thread may stop waiting.
+   */
+  template <typename Predicate>
+  static void wait(std::unique_lock<std::mutex>& lock,
+                   std::condition_variable& cv, waiters& waiting,
+                   Predicate ready);
+
+  /**
+   * Waits according to WaitPolicy until ready returns true or deadline
+   * passes. Parks on cv if needed, counting the calling thread in waiting.
+   * @param lock The held lock on m_mutex.
+   * @param cv The condition variable to block on.
+   * @param waiting The threads blocked on cv.
+   * @param deadline The latest time to wait.
+   * @param ready Returns whether the thread may stop waiting.
+   * @returns The final value of ready.
+   */
+  template <typename Predicate, typename Clock, typename Duration>
+  static bool wait_until(
+      std::unique_lock<std::mutex>& lock, std::condition_variable& cv,
+      waiters& waiting,
+      const std::chrono::time_point<Clock, Duration>& deadline,
+      Predicate ready);
+
+  /**
+   * Wakes up to count threads blocked on cv.
+   * Called after m_mutex is released so woken threads do not block on it.
+   * @param cv The condition variable to signal.
+   * @param count The number of threads to wake.
+   */
+  static void notify(std::condition_variable& cv, size_t count);
+
+  /**
+   * Releases m_mutex, then wakes consumers and producers together with
+   * the threads claimed by serve_awaiters since the last call.
+   * @param lock The held lock on m_mutex.
+   * @param consumers The number of consumers to wake.
+   * @param producers The number of producers to wake.
+   */
+  void unlock_and_notify(std::unique_lock<std::mutex>& lock,
+                         size_t consumers, size_t producers);
+
+  /**
+   * Determines whether a producer may stop waiting.
+   * Exact when the caller holds m_mutex, approximate otherwise.
+   * @returns Whether the queue has space or is closed.
+   */
+  bool push_ready() const;
+
+  /**
+   * Determines whether a consumer may stop waiting.
+   * Exact when the caller holds m_mutex, approximate otherwise.
+   * @returns Whether the queue has an element or is closed.
+   */
+  bool pop_ready() const;
 
  public:
   /**
-   * Default constructor initializes empty queue.
+   * Capacity of a queue that never blocks producers.
+   */
+  static constexpr size_t UNBOUNDED = std::numeric_limits<size_t>::max();
+
+  /**
+   * Default constructor initializes empty, unbounded queue.
    */
-  blocking_queue() = default;
+  blocking_queue();
+
+  /**
+   * Initializes empty queue holding at most capacity elements.
+   * Producers block in push while the queue is full.
+   * @param capacity The maximum number of elements. Must be positive.
+   */
+  explicit blocking_queue(size_t capacity);
+
+  /**
+   * Initializes empty queue whose storage allocates from alloc.
+   * @param capacity The maximum number of elements, or UNBOUNDED.
+   * @param alloc The allocator passed to the constructor of Storage,
+   *              such as a std::pmr::memory_resource pointer.
+   */
+  template <typename Allocator>
+  blocking_queue(size_t capacity, const Allocator& alloc);
 
   /**
    * Prevent copying construction of blocking queue.
    */
-  blocking_queue(const blocking_queue<T>&) = delete;
+  blocking_queue(const blocking_queue&) = delete;
 
   /**
    * Prevent assignment of blocking queue.
    */
-  blocking_queue<T>& operator=(blocking_queue<T>) = delete;
+  blocking_queue& operator=(blocking_queue) = delete;
 
   /**
-   * Determines whether the queue is empty
-   * at some non-deterministic time in the future.
+   * Determines whether the queue is empty without taking the lock.
+   * The result is approximate while other threads push or pop.
    * @returns The queue's emptiness status.
    */
-  bool empty();
+  bool empty() const;
 
   /**
-   * Determines the number of elements in the queue
-   * at some non-deterministic time in the future.
+   * Determines the number of elements in the queue without taking the
+   * lock. The result is approximate while other threads push or pop.
    * @returns The size of the queue.
    */
-  size_t size();
+  size_t size() const;
+
+  /**
+   * Returns the maximum number of elements the queue holds.
+   * @returns The capacity, or UNBOUNDED.
+   */
+  size_t capacity() const;
+
+  /**
+   * Closes the queue and wakes every blocked thread. Later pushes fail
+   * and pops return nothing once the remaining elements are drained.
+   */
+  void close();
+
+  /**
+   * Determines whether the queue has been closed without taking the lock.
+   * @returns The queue's closed status.
+   */
+  bool closed() const;
+
+  /**
+   * Registers a listener to be notified with key whenever the queue goes
+   * from empty to non-empty or is closed. Notifies it at once if the
+   * queue is already non-empty or closed.
+   * @param listener The listener, which must stay alive until it is
+   *                 unsubscribed.
+   * @param key The key passed to the listener.
+   * @throws std::invalid_argument if the listener does not accept key.
+   */
+  void subscribe(queue_listener& listener, size_t key);
+
+  /**
+   * Removes every subscription of a listener. Once this returns, the
+   * queue no longer calls the listener.
+   * @param listener The listener to remove.
+   */
+  void unsubscribe(queue_listener& listener);
 
   /**
    * Pushes an element onto the queue, blocking if needed.
+   * The copy is made in the storage, with its allocator.
+   * @param elem The item to enqueue.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(const T& elem);
+
+  /**
+   * Moves an element onto the queue, blocking if needed.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(T&& elem);
+
+  /**
+   * Constructs an element from args and pushes it, blocking if needed.
+   * The element is constructed in the storage under the lock, so an
+   * allocator-aware element uses the storage's allocator.
+   * @param args The arguments forwarded to the constructor of T.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  template <typename... Args>
+  bool emplace(Args&&... args);
+
+  /**
+   * Pushes an element onto the queue only if it is not full or closed.
+   * @param elem The item to enqueue.
+   * @returns Whether the element was enqueued.
+   */
+  bool try_push(const T& elem);
+
+  /**
+   * Moves an element onto the queue only if it is not full or closed.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @returns Whether the element was enqueued.
+   */
+  bool try_push(T&& elem);
+
+  /**
+   * Pushes an element onto the queue, blocking for at most timeout.
+   * @param elem The item to enqueue.
+   * @param timeout The longest time to wait for space.
+   * @returns Whether the element was enqueued.
+   */
+  template <typename Rep, typename Period>
+  bool push_for(const T& elem,
+                const std::chrono::duration<Rep, Period>& timeout);
+
+  /**
+   * Moves an element onto the queue, blocking for at most timeout.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @param timeout The longest time to wait for space.
+   * @returns Whether the element was enqueued.
+   */
+  template <typename Rep, typename Period>
+  bool push_for(T&& elem, const std::chrono::duration<Rep, Period>& timeout);
+
+  /**
+   * Pushes an element onto the queue, blocking until at most deadline.
    * @param elem The item to enqueue.
+   * @param deadline The latest time to wait for space.
+   * @returns Whether the element was enqueued.
+   */
+  template <typename Clock, typename Duration>
+  bool push_until(const T& elem,
+                  const std::chrono::time_point<Clock, Duration>& deadline);
+
+  /**
+   * Moves an element onto the queue, blocking until at most deadline.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @param deadline The latest time to wait for space.
+   * @returns Whether the element was enqueued.
    */
-  void push(const T& elem);
+  template <typename Clock, typename Duration>
+  bool push_until(T&& elem,
+                  const std::chrono::time_point<Clock, Duration>& deadline);
+
+  /**
+   * Pushes every element of [first, last) onto the queue, taking the lock
+   * once per batch instead of once per element. Blocks while the queue is
+   * full. Pass move iterators to move the elements in.
+   * @param first The beginning of the range to enqueue.
+   * @param last The end of the range to enqueue.
+   * @returns Whether the whole range was enqueued, false if closed.
+   */
+  template <typename InputIt>
+  bool push_range(InputIt first, InputIt last);
 
   /**
    * Removes and returns an element from the queue, blocking if needed.
-   * @returns the next element in the queue.
+   * @returns The next element, or nothing if closed and drained.
+   */
+  std::optional<T> pop();
+
+  /**
+   * Removes and returns an element only if one is available.
+   * @returns The next element, or nothing if the queue is empty.
+   */
+  std::optional<T> try_pop();
+
+  /**
+   * Removes and returns an element, blocking for at most timeout.
+   * @param timeout The longest time to wait for an element.
+   * @returns The next element, or nothing if the timeout expired
+   *          or the queue is closed and drained.
+   */
+  template <typename Rep, typename Period>
+  std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout);
+
+  /**
+   * Removes and returns an element, blocking until at most deadline.
+   * @param deadline The latest time to wait for an element.
+   * @returns The next element, or nothing if the deadline passed
+   *          or the queue is closed and drained.
    */
-  T pop();
+  template <typename Clock, typename Duration>
+  std::optional<T> pop_until(
+      const std::chrono::time_point<Clock, Duration>& deadline);
+
+  /**
+   * Removes up to max_n elements under a single lock acquisition,
+   * blocking until at least one element is available.
+   * @param out The output iterator receiving the elements in FIFO order.
+   * @param max_n The maximum number of elements to remove.
+   * @returns The number of elements removed, zero if closed and drained.
+   */
+  template <typename OutputIt>
+  size_t pop_bulk(OutputIt out, size_t max_n);
+
+#if defined(BLOCKING_QUEUE_COROUTINES)
+  /**
+   * Awaitable returned by async_pop.
+   */
+  class pop_awaitable {
+   private:
+    blocking_queue& m_owner;
+    awaiter m_node;
+
+   public:
+    /**
+     * Initializes awaitable popping from owner.
+     * @param owner The queue to pop from.
+     * @param executor The executor to resume on.
+     * @param schedule Schedules a coroutine on executor.
+     */
+    pop_awaitable(blocking_queue& owner, void* executor,
+                  void (*schedule)(void*, std::coroutine_handle<>));
+
+    /**
+     * Always suspends, since checking the queue needs its lock.
+     * @returns False.
+     */
+    bool await_ready() const noexcept;
+
+    /**
+     * Takes an element at once if one is available or the queue is
+     * closed, and otherwise queues the coroutine to wait.
+     * @param handle The suspended coroutine.
+     * @returns Whether the coroutine stays suspended.
+     */
+    bool await_suspend(std::coroutine_handle<> handle);
+
+    /**
+     * Returns the result of the pop.
+     * @returns The next element, or nothing if closed and drained.
+     */
+    std::optional<T> await_resume();
+  };
+
+  /**
+   * Awaitable returned by async_push.
+   */
+  class push_awaitable {
+   private:
+    blocking_queue& m_owner;
+    awaiter m_node;
+
+   public:
+    /**
+     * Initializes awaitable pushing elem onto owner.
+     * @param owner The queue to push onto.
+     * @param elem The item to enqueue.
+     * @param executor The executor to resume on.
+     * @param schedule Schedules a coroutine on executor.
+     */
+    push_awaitable(blocking_queue& owner, T&& elem, void* executor,
+                   void (*schedule)(void*, std::coroutine_handle<>));
+
+    /**
+     * Always suspends, since checking the queue needs its lock.
+     * @returns False.
+     */
+    bool await_ready() const noexcept;
+
+    /**
+     * Enqueues the element at once if there is space or the queue is
+     * closed, and otherwise queues the coroutine to wait.
+     * @param handle The suspended coroutine.
+     * @returns Whether the coroutine stays suspended.
+     */
+    bool await_suspend(std::coroutine_handle<> handle);
+
+    /**
+     * Returns the result of the push.
+     * @returns Whether the element was enqueued, false if closed.
+     */
+    bool await_resume();
+  };
+
+  /**
+   * Removes an element from within a coroutine. If the queue is empty,
+   * suspends the coroutine without blocking the thread, and resumes it on
+   * executor once an element arrives or the queue is closed. Otherwise
+   * the coroutine continues at once on the calling thread. A suspended
+   * coroutine must not be destroyed.
+   * @param executor Resumes coroutines through a thread safe member
+   *                 schedule(std::coroutine_handle<>), which must not
+   *                 resume the coroutine before returning.
+   * @returns Awaitable yielding the next element, or nothing if closed
+   *          and drained.
+   */
+  template <typename Executor>
+  pop_awaitable async_pop(Executor& executor);
+
+  /**
+   * Pushes an element from within a coroutine. If the queue is full,
+   * suspends the coroutine without blocking the thread, and resumes it on
+   * executor once there is space or the queue is closed. Otherwise the
+   * coroutine continues at once on the calling thread. A suspended
+   * coroutine must not be destroyed.
+   * @param elem The item to enqueue.
+   * @param executor Resumes coroutines as in async_pop.
+   * @returns Awaitable yielding whether the element was enqueued,
+   *          false if closed.
+   */
+  template <typename Executor>
+  push_awaitable async_push(T elem, Executor& executor);
+#endif
 };
 
-template <typename T>
-bool blocking_queue<T>::empty() {
-  std::lock_guard lock(m_mutex);
-  return m_queue.empty();
+#if defined(BLOCKING_QUEUE_COROUTINES)
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Executor>
+void blocking_queue<T, WaitPolicy, Storage>::schedule_on(
+    void* executor, std::coroutine_handle<> handle) {
+  static_cast<Executor*>(executor)->schedule(handle);
+}
+#endif
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename... Args>
+void blocking_queue<T, WaitPolicy, Storage>::store(Args&&... args) {
+  m_queue.emplace(std::forward<Args>(args)...);
+  const auto size = m_queue.size();
+  m_size.store(size, std::memory_order_relaxed);
+  if (size == 1) notify_listeners();
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+T blocking_queue<T, WaitPolicy, Storage>::take() {
+  T elem = std::move(m_queue.front());
+  m_queue.pop();
+  m_size.store(m_queue.size(), std::memory_order_relaxed);
+  return elem;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+void blocking_queue<T, WaitPolicy, Storage>::serve_awaiters() {
+#if defined(BLOCKING_QUEUE_COROUTINES)
+  while (true) {
+    awaiter* ready = nullptr;
+    if (!m_pop_awaiters.empty() && (m_closed || !m_queue.empty())) {
+      ready = m_pop_awaiters.pop();
+      if (!m_queue.empty()) {
+        ready->elem.emplace(take());
+        m_served_producers += m_producers.claim(1);
+      }
+    } else if (!m_push_awaiters.empty() &&
+               (m_closed || m_queue.size() < m_capacity)) {
+      ready = m_push_awaiters.pop();
+      if (!m_closed) {
+        store(std::move(*ready->elem));
+        ready->pushed = true;
+        m_served_consumers += m_consumers.claim(1);
+      }
+    } else {
+      break;
+    }
+    // schedule never resumes inline, so the queue is not re-entered under
+    // m_mutex. Another thread may resume the coroutine and destroy its
+    // awaiter as soon as it is scheduled, so ready is not used after.
+    ready->schedule(ready->executor, ready->handle);
+  }
+#endif
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename... Args>
+void blocking_queue<T, WaitPolicy, Storage>::enqueue(Args&&... args) {
+  store(std::forward<Args>(args)...);
+  serve_awaiters();
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename... Args>
+bool blocking_queue<T, WaitPolicy, Storage>::try_emplace(Args&&... args) {
+  std::unique_lock lock(m_mutex);
+  if (m_closed || m_queue.size() >= m_capacity) return false;
+  enqueue(std::forward<Args>(args)...);
+  unlock_and_notify(lock, m_consumers.claim(1), 0);
+  return true;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Clock, typename Duration, typename... Args>
+bool blocking_queue<T, WaitPolicy, Storage>::emplace_until(
+    const std::chrono::time_point<Clock, Duration>& deadline,
+    Args&&... args) {
+  std::unique_lock lock(m_mutex);
+  if (!wait_until(lock, m_not_full, m_producers, deadline,
+                  [this] { return push_ready(); }) ||
+      m_closed)
+    return false;
+  enqueue(std::forward<Args>(args)...);
+  unlock_and_notify(lock, m_consumers.claim(1), 0);
+  return true;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+T blocking_queue<T, WaitPolicy, Storage>::dequeue() {
+  T elem = take();
+  serve_awaiters();
+  return elem;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+void blocking_queue<T, WaitPolicy, Storage>::notify_listeners() {
+  for (const auto& [listener, key] : m_listeners) listener->notify(key);
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Predicate>
+void blocking_queue<T, WaitPolicy, Storage>::wait(
+    std::unique_lock<std::mutex>& lock, std::condition_variable& cv,
+    waiters& waiting, Predicate ready) {
+  const auto forever = std::chrono::steady_clock::time_point::max();
+  if (WaitPolicy::spin(lock, ready, forever)) return;
+  waiting.enter();
+  while (!ready()) {
+    cv.wait(lock);
+    waiting.wake_up();
+  }
+  waiting.leave();
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Predicate, typename Clock, typename Duration>
+bool blocking_queue<T, WaitPolicy, Storage>::wait_until(
+    std::unique_lock<std::mutex>& lock, std::condition_variable& cv,
+    waiters& waiting, const std::chrono::time_point<Clock, Duration>& deadline,
+    Predicate ready) {
+  if (WaitPolicy::spin(lock, ready, deadline)) return true;
+  waiting.enter();
+  while (!ready()) {
+    const auto status = cv.wait_until(lock, deadline);
+    waiting.wake_up();
+    if (status == std::cv_status::timeout) break;
+  }
+  waiting.leave();
+  return ready();
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+void blocking_queue<T, WaitPolicy, Storage>::notify(
+    std::condition_variable& cv, size_t count) {
+  for (size_t i = 0; i < count; ++i) cv.notify_one();
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+void blocking_queue<T, WaitPolicy, Storage>::unlock_and_notify(
+    std::unique_lock<std::mutex>& lock, size_t consumers, size_t producers) {
+  consumers += std::exchange(m_served_consumers, 0);
+  producers += std::exchange(m_served_producers, 0);
+  lock.unlock();
+  notify(m_not_empty, consumers);
+  notify(m_not_full, producers);
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::push_ready() const {
+  return m_closed.load(std::memory_order_relaxed) ||
+         m_size.load(std::memory_order_relaxed) < m_capacity;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::pop_ready() const {
+  return m_closed.load(std::memory_order_relaxed) ||
+         m_size.load(std::memory_order_relaxed) != 0;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+blocking_queue<T, WaitPolicy, Storage>::blocking_queue()
+    : blocking_queue(UNBOUNDED) {}
+
+template <typename T, typename WaitPolicy, typename Storage>
+blocking_queue<T, WaitPolicy, Storage>::blocking_queue(size_t capacity)
+    : m_capacity(capacity) {
+  if (capacity == 0)
+    throw std::invalid_argument("blocking_queue capacity must be positive");
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Allocator>
+blocking_queue<T, WaitPolicy, Storage>::blocking_queue(size_t capacity,
+                                                       const Allocator& alloc)
+    : m_queue(alloc), m_capacity(capacity) {
+  if (capacity == 0)
+    throw std::invalid_argument("blocking_queue capacity must be positive");
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::empty() const {
+  return size() == 0;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+size_t blocking_queue<T, WaitPolicy, Storage>::size() const {
+  return m_size.load(std::memory_order_relaxed);
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+size_t blocking_queue<T, WaitPolicy, Storage>::capacity() const {
+  return m_capacity;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+void blocking_queue<T, WaitPolicy, Storage>::close() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_closed = true;
+    notify_listeners();
+    serve_awaiters();
+    // Every blocked thread is woken below, including those claimed.
+    m_served_consumers = m_served_producers = 0;
+  }
+  m_not_empty.notify_all();
+  m_not_full.notify_all();
 }
 
-template <typename T>
-size_t blocking_queue<T>::size() {
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::closed() const {
+  return m_closed.load(std::memory_order_relaxed);
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+void blocking_queue<T, WaitPolicy, Storage>::subscribe(
+    queue_listener& listener, size_t key) {
+  if (!listener.accepts(key))
+    throw std::invalid_argument("listener does not accept the key");
   std::lock_guard lock(m_mutex);
-  return m_queue.size();
+  m_listeners.emplace_back(&listener, key);
+  if (m_closed || !m_queue.empty()) listener.notify(key);
 }
 
-template <typename T>
-void blocking_queue<T>::push(const T& elem) {
+template <typename T, typename WaitPolicy, typename Storage>
+void blocking_queue<T, WaitPolicy, Storage>::unsubscribe(
+    queue_listener& listener) {
   std::lock_guard lock(m_mutex);
-  m_queue.push(elem);
-  m_cv.notify_one();
+  m_listeners.erase(
+      std::remove_if(m_listeners.begin(), m_listeners.end(),
+                     [&](const auto& each) { return each.first == &listener; }),
+      m_listeners.end());
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::push(const T& elem) {
+  return emplace(elem);
 }
 
-template <typename T>
-T blocking_queue<T>::pop() {
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::push(T&& elem) {
+  return emplace(std::move(elem));
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename... Args>
+bool blocking_queue<T, WaitPolicy, Storage>::emplace(Args&&... args) {
   std::unique_lock lock(m_mutex);
-  m_cv.wait(lock, [this] { return !m_queue.empty(); });
-  T elem = std::move(m_queue.front());
-  m_queue.pop();
+  wait(lock, m_not_full, m_producers, [this] { return push_ready(); });
+  if (m_closed) return false;
+  enqueue(std::forward<Args>(args)...);
+  unlock_and_notify(lock, m_consumers.claim(1), 0);
+  return true;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::try_push(const T& elem) {
+  return try_emplace(elem);
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::try_push(T&& elem) {
+  return try_emplace(std::move(elem));
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Rep, typename Period>
+bool blocking_queue<T, WaitPolicy, Storage>::push_for(
+    const T& elem, const std::chrono::duration<Rep, Period>& timeout) {
+  return emplace_until(std::chrono::steady_clock::now() + timeout, elem);
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Rep, typename Period>
+bool blocking_queue<T, WaitPolicy, Storage>::push_for(
+    T&& elem, const std::chrono::duration<Rep, Period>& timeout) {
+  return push_until(std::move(elem),
+                    std::chrono::steady_clock::now() + timeout);
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Clock, typename Duration>
+bool blocking_queue<T, WaitPolicy, Storage>::push_until(
+    const T& elem, const std::chrono::time_point<Clock, Duration>& deadline) {
+  return emplace_until(deadline, elem);
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Clock, typename Duration>
+bool blocking_queue<T, WaitPolicy, Storage>::push_until(
+    T&& elem, const std::chrono::time_point<Clock, Duration>& deadline) {
+  return emplace_until(deadline, std::move(elem));
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename InputIt>
+bool blocking_queue<T, WaitPolicy, Storage>::push_range(InputIt first,
+                                                        InputIt last) {
+  std::unique_lock lock(m_mutex);
+  size_t wakeups = 0;
+  bool pushed_all = true;
+  while (first != last) {
+    if (!push_ready()) {
+      // Consumers must learn about this batch before we block on them.
+      unlock_and_notify(lock, wakeups, 0);
+      lock.lock();
+      wakeups = 0;
+      wait(lock, m_not_full, m_producers,
+           [this] { return push_ready(); });
+    }
+    if (m_closed) {
+      pushed_all = false;
+      break;
+    }
+    size_t pushed = 0;
+    for (; first != last && m_queue.size() < m_capacity; ++first, ++pushed)
+      enqueue(*first);
+    wakeups += m_consumers.claim(pushed);
+  }
+  unlock_and_notify(lock, wakeups, 0);
+  return pushed_all;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+std::optional<T> blocking_queue<T, WaitPolicy, Storage>::pop() {
+  std::unique_lock lock(m_mutex);
+  wait(lock, m_not_empty, m_consumers, [this] { return pop_ready(); });
+  if (m_queue.empty()) return std::nullopt;
+  std::optional<T> elem(dequeue());
+  unlock_and_notify(lock, 0, m_producers.claim(1));
+  return elem;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+std::optional<T> blocking_queue<T, WaitPolicy, Storage>::try_pop() {
+  std::unique_lock lock(m_mutex);
+  if (m_queue.empty()) return std::nullopt;
+  std::optional<T> elem(dequeue());
+  unlock_and_notify(lock, 0, m_producers.claim(1));
+  return elem;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Rep, typename Period>
+std::optional<T> blocking_queue<T, WaitPolicy, Storage>::pop_for(
+    const std::chrono::duration<Rep, Period>& timeout) {
+  return pop_until(std::chrono::steady_clock::now() + timeout);
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Clock, typename Duration>
+std::optional<T> blocking_queue<T, WaitPolicy, Storage>::pop_until(
+    const std::chrono::time_point<Clock, Duration>& deadline) {
+  std::unique_lock lock(m_mutex);
+  if (!wait_until(lock, m_not_empty, m_consumers, deadline,
+                  [this] { return pop_ready(); }) ||
+      m_queue.empty())
+    return std::nullopt;
+  std::optional<T> elem(dequeue());
+  unlock_and_notify(lock, 0, m_producers.claim(1));
   return elem;
 }
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename OutputIt>
+size_t blocking_queue<T, WaitPolicy, Storage>::pop_bulk(OutputIt out,
+                                                        size_t max_n) {
+  if (max_n == 0) return 0;
+  std::unique_lock lock(m_mutex);
+  wait(lock, m_not_empty, m_consumers, [this] { return pop_ready(); });
+  size_t popped = 0;
+  for (; popped < max_n && !m_queue.empty(); ++popped, ++out)
+    *out = dequeue();
+  unlock_and_notify(lock, 0, m_producers.claim(popped));
+  return popped;
+}
+
+#if defined(BLOCKING_QUEUE_COROUTINES)
+template <typename T, typename WaitPolicy, typename Storage>
+blocking_queue<T, WaitPolicy, Storage>::pop_awaitable::pop_awaitable(
+    blocking_queue& owner, void* executor,
+    void (*schedule)(void*, std::coroutine_handle<>))
+    : m_owner(owner) {
+  m_node.executor = executor;
+  m_node.schedule = schedule;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::pop_awaitable::await_ready()
+    const noexcept {
+  return false;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::pop_awaitable::await_suspend(
+    std::coroutine_handle<> handle) {
+  std::unique_lock lock(m_owner.m_mutex);
+  if (m_owner.m_queue.empty()) {
+    if (m_owner.m_closed) return false;
+    m_node.handle = handle;
+    m_owner.m_pop_awaiters.push(&m_node);
+    return true;
+  }
+  m_node.elem.emplace(m_owner.dequeue());
+  m_owner.unlock_and_notify(lock, 0, m_owner.m_producers.claim(1));
+  return false;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+std::optional<T>
+blocking_queue<T, WaitPolicy, Storage>::pop_awaitable::await_resume() {
+  return std::move(m_node.elem);
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+blocking_queue<T, WaitPolicy, Storage>::push_awaitable::push_awaitable(
+    blocking_queue& owner, T&& elem, void* executor,
+    void (*schedule)(void*, std::coroutine_handle<>))
+    : m_owner(owner) {
+  m_node.executor = executor;
+  m_node.schedule = schedule;
+  m_node.elem.emplace(std::move(elem));
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::push_awaitable::await_ready()
+    const noexcept {
+  return false;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::push_awaitable::await_suspend(
+    std::coroutine_handle<> handle) {
+  std::unique_lock lock(m_owner.m_mutex);
+  if (m_owner.m_closed) return false;
+  if (m_owner.m_queue.size() >= m_owner.m_capacity) {
+    m_node.handle = handle;
+    m_owner.m_push_awaiters.push(&m_node);
+    return true;
+  }
+  m_owner.enqueue(std::move(*m_node.elem));
+  m_node.pushed = true;
+  m_owner.unlock_and_notify(lock, m_owner.m_consumers.claim(1), 0);
+  return false;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+bool blocking_queue<T, WaitPolicy, Storage>::push_awaitable::await_resume() {
+  return m_node.pushed;
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Executor>
+typename blocking_queue<T, WaitPolicy, Storage>::pop_awaitable
+blocking_queue<T, WaitPolicy, Storage>::async_pop(Executor& executor) {
+  return pop_awaitable(*this, &executor, &schedule_on<Executor>);
+}
+
+template <typename T, typename WaitPolicy, typename Storage>
+template <typename Executor>
+typename blocking_queue<T, WaitPolicy, Storage>::push_awaitable
+blocking_queue<T, WaitPolicy, Storage>::async_push(T elem,
+                                                   Executor& executor) {
+  return push_awaitable(*this, std::move(elem), &executor,
+                        &schedule_on<Executor>);
+}
+#endif
+
+namespace pmr {
+
+/**
+ * Blocking queue whose storage allocates from a std::pmr::memory_resource.
+ * Elements that are allocator-aware, such as std::pmr::string, are
+ * constructed with the same resource.
+ */
+template <typename T, typename WaitPolicy = block_wait>
+using blocking_queue =
+    ::blocking_queue<T, WaitPolicy, std::queue<T, std::pmr::deque<T>>>;
+
+}  // namespace pmr
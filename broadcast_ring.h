@@ -0,0 +1,418 @@
+/*
+Bounded ring buffer that delivers every element to every subscriber.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "queue_util.h"
+
+/**
+ * Disruptor-style broadcast ring for any number of producers and a fixed
+ * number of subscribers. A producer claims a sequence number, writes its
+ * element into the slot for that sequence once, and stamps the slot as
+ * published. Each subscriber reads the slots in order and advances only
+ * its own cursor, so fan-out to n subscribers costs one write and n reads
+ * with no copies through intermediate queues. A producer waits while the
+ * slowest subscriber is a full ring behind, which applies backpressure.
+ * Threads park on a condition variable only when the ring is full or a
+ * subscriber has caught up.
+ * @tparam T The element type, which must be default constructible and
+ *           move assignable because slots are reused in place.
+ */
+template <typename T>
+class broadcast_ring {
+ private:
+  static_assert(std::is_default_constructible_v<T> &&
+                    std::is_move_assignable_v<T>,
+                "broadcast_ring elements must be reusable in place");
+
+  // Element with the sequence number after the one it was published for,
+  // or zero if it was never published.
+  struct slot {
+    std::atomic<size_t> stamp{0};
+    T value;
+  };
+
+  // Read position of one subscriber on its own cache line.
+  struct alignas(CACHE_LINE) cursor {
+    std::atomic<size_t> next{0};
+  };
+
+  // Bit of m_claim set once the ring is closed.
+  static constexpr size_t CLOSED =
+      size_t(1) << (std::numeric_limits<size_t>::digits - 1);
+
+  // Number of slots, a power of two, and the mask to index them.
+  const size_t m_capacity;
+  const size_t m_mask;
+  std::unique_ptr<slot[]> m_slots;
+
+  // Number of subscribers and their cursors.
+  const size_t m_subscribers;
+  std::unique_ptr<cursor[]> m_cursors;
+
+  // Next sequence number to claim, with the CLOSED bit.
+  alignas(CACHE_LINE) std::atomic<size_t> m_claim{0};
+
+  // Lower bound on every cursor, refreshed when a producer finds the ring
+  // full, so producers rarely scan all cursors.
+  alignas(CACHE_LINE) std::atomic<size_t> m_gate{0};
+
+  // Parking fallback, only touched when the ring is full or caught up.
+  // Each flag is set by threads about to park and cleared by the first
+  // thread to wake them, so later updates skip the mutex.
+  alignas(CACHE_LINE) std::atomic<bool> m_subscribers_parked{false};
+  std::atomic<bool> m_producers_parked{false};
+  std::mutex m_mutex;
+  std::condition_variable m_published;
+  std::condition_variable m_released;
+
+  /**
+   * Determines whether the slot for seq is free for a producer, i.e.
+   * whether every subscriber has read sequence seq minus the capacity.
+   * @param seq The claimed sequence number.
+   * @returns Whether seq may be written.
+   */
+  bool has_room(size_t seq);
+
+  /**
+   * Determines whether the next element for a subscriber is published.
+   * @param subscriber The index of the subscriber.
+   * @returns Whether a consume would find an element.
+   */
+  bool readable(size_t subscriber) const;
+
+  /**
+   * Determines whether a subscriber has read every element of a closed
+   * ring.
+   * @param subscriber The index of the subscriber.
+   * @returns Whether the subscriber will never receive another element.
+   */
+  bool drained(size_t subscriber) const;
+
+  /**
+   * Writes an element into the slot for seq and publishes it.
+   * @param seq The claimed sequence number, which must have room.
+   * @param elem The item to publish.
+   */
+  void write(size_t seq, T&& elem);
+
+  /**
+   * Wakes every parked thread if any announced that it is about to park.
+   * Subscribers wait for the same elements and producers for different
+   * slots, so all of them are woken.
+   * @param parked The flag of the other side.
+   * @param cv The condition variable the other side parks on.
+   */
+  void wake(std::atomic<bool>& parked, std::condition_variable& cv);
+
+  /**
+   * Parks the calling thread until ready returns true.
+   * @param parked The flag announcing the calling thread's side.
+   * @param cv The condition variable to park on.
+   * @param ready Returns whether the thread may stop waiting.
+   */
+  template <typename Predicate>
+  void park(std::atomic<bool>& parked, std::condition_variable& cv,
+            Predicate ready);
+
+ public:
+  /**
+   * Initializes an empty ring.
+   * @param capacity The minimum number of elements. Must be positive.
+   *                 Rounded up to a power of two.
+   * @param subscribers The number of subscribers, which are identified by
+   *                    the indices below it. Must be positive.
+   */
+  broadcast_ring(size_t capacity, size_t subscribers);
+
+  /**
+   * Prevent copying construction of broadcast ring.
+   */
+  broadcast_ring(const broadcast_ring&) = delete;
+
+  /**
+   * Prevent assignment of broadcast ring.
+   */
+  broadcast_ring& operator=(broadcast_ring) = delete;
+
+  /**
+   * Returns the number of slots.
+   * @returns The capacity.
+   */
+  size_t capacity() const;
+
+  /**
+   * Returns the number of subscribers.
+   * @returns The number of subscribers.
+   */
+  size_t subscribers() const;
+
+  /**
+   * Approximates the number of elements claimed by producers but not yet
+   * read by a subscriber.
+   * @param subscriber The index of the subscriber.
+   * @returns How far the subscriber is behind.
+   */
+  size_t backlog(size_t subscriber) const;
+
+  /**
+   * Closes the ring and wakes every parked thread. Later publishes fail,
+   * while subscribers still receive every element claimed before close.
+   */
+  void close();
+
+  /**
+   * Determines whether the ring has been closed.
+   * @returns The ring's closed status.
+   */
+  bool closed() const;
+
+  /**
+   * Publishes a copy of an element to every subscriber, blocking while
+   * the slowest subscriber is a full ring behind.
+   * @param elem The item to publish.
+   * @returns Whether the element was published, false if closed.
+   */
+  bool publish(const T& elem);
+
+  /**
+   * Publishes an element to every subscriber, blocking while the slowest
+   * subscriber is a full ring behind.
+   * @param elem The item to publish. Left untouched on failure.
+   * @returns Whether the element was published, false if closed.
+   */
+  bool publish(T&& elem);
+
+  /**
+   * Publishes an element only if no subscriber is a full ring behind.
+   * @param elem The item to publish. Left untouched on failure.
+   * @returns Whether the element was published.
+   */
+  bool try_publish(T&& elem);
+
+  /**
+   * Passes the next published elements to handler in order, blocking
+   * until at least one is available. The cursor advances once for the
+   * whole batch. Each subscriber index must be used by one thread at a
+   * time.
+   * @param subscriber The index of the subscriber.
+   * @param handler Invoked with a const reference to each element.
+   *                Must not throw.
+   * @param max_n The maximum number of elements to handle.
+   * @returns The number of elements handled, zero if closed and drained.
+   */
+  template <typename Handler>
+  size_t consume(size_t subscriber, Handler&& handler,
+                 size_t max_n = std::numeric_limits<size_t>::max());
+
+  /**
+   * Passes the next published elements to handler in order without
+   * blocking, as in consume.
+   * @param subscriber The index of the subscriber.
+   * @param handler Invoked with a const reference to each element.
+   *                Must not throw.
+   * @param max_n The maximum number of elements to handle.
+   * @returns The number of elements handled.
+   */
+  template <typename Handler>
+  size_t try_consume(size_t subscriber, Handler&& handler,
+                     size_t max_n = std::numeric_limits<size_t>::max());
+
+  /**
+   * Copies out the next element for a subscriber, blocking until it is
+   * published.
+   * @param subscriber The index of the subscriber.
+   * @returns The next element, or nothing if closed and drained.
+   */
+  std::optional<T> receive(size_t subscriber);
+};
+
+template <typename T>
+bool broadcast_ring<T>::has_room(size_t seq) {
+  if (seq < m_gate.load(std::memory_order_acquire) + m_capacity) return true;
+  auto slowest = std::numeric_limits<size_t>::max();
+  for (size_t idx = 0; idx < m_subscribers; ++idx)
+    slowest = std::min(slowest,
+                       m_cursors[idx].next.load(std::memory_order_acquire));
+  // Cursors only advance, so a stale store merely causes another scan.
+  m_gate.store(slowest, std::memory_order_release);
+  return seq < slowest + m_capacity;
+}
+
+template <typename T>
+bool broadcast_ring<T>::readable(size_t subscriber) const {
+  const auto seq = m_cursors[subscriber].next.load(std::memory_order_relaxed);
+  return m_slots[seq & m_mask].stamp.load(std::memory_order_acquire) ==
+         seq + 1;
+}
+
+template <typename T>
+bool broadcast_ring<T>::drained(size_t subscriber) const {
+  const auto claim = m_claim.load(std::memory_order_acquire);
+  return (claim & CLOSED) &&
+         m_cursors[subscriber].next.load(std::memory_order_relaxed) ==
+             (claim & ~CLOSED);
+}
+
+template <typename T>
+void broadcast_ring<T>::write(size_t seq, T&& elem) {
+  auto& cell = m_slots[seq & m_mask];
+  cell.value = std::move(elem);
+  cell.stamp.store(seq + 1, std::memory_order_release);
+  wake(m_subscribers_parked, m_published);
+}
+
+template <typename T>
+void broadcast_ring<T>::wake(std::atomic<bool>& parked,
+                             std::condition_variable& cv) {
+  // Pairs with the fence in park: either the parking thread sees our
+  // update, or we see its announcement and notify it.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!parked.load(std::memory_order_relaxed)) return;
+  {
+    // Every thread parked now is woken below and announces itself again
+    // if it has to park once more.
+    std::lock_guard lock(m_mutex);
+    parked.store(false, std::memory_order_relaxed);
+  }
+  cv.notify_all();
+}
+
+template <typename T>
+template <typename Predicate>
+void broadcast_ring<T>::park(std::atomic<bool>& parked,
+                             std::condition_variable& cv, Predicate ready) {
+  std::unique_lock lock(m_mutex);
+  while (true) {
+    parked.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ready()) return;
+    cv.wait(lock);
+  }
+}
+
+template <typename T>
+broadcast_ring<T>::broadcast_ring(size_t capacity, size_t subscribers)
+    : m_capacity(ring_capacity(capacity)),
+      m_mask(m_capacity - 1),
+      m_slots(new slot[m_capacity]),
+      m_subscribers(subscribers),
+      m_cursors(new cursor[subscribers]) {
+  if (subscribers == 0)
+    throw std::invalid_argument("broadcast_ring needs a subscriber");
+}
+
+template <typename T>
+size_t broadcast_ring<T>::capacity() const {
+  return m_capacity;
+}
+
+template <typename T>
+size_t broadcast_ring<T>::subscribers() const {
+  return m_subscribers;
+}
+
+template <typename T>
+size_t broadcast_ring<T>::backlog(size_t subscriber) const {
+  const auto claim = m_claim.load(std::memory_order_relaxed) & ~CLOSED;
+  const auto next = m_cursors[subscriber].next.load(std::memory_order_relaxed);
+  return claim > next ? claim - next : 0;
+}
+
+template <typename T>
+void broadcast_ring<T>::close() {
+  m_claim.fetch_or(CLOSED, std::memory_order_release);
+  { std::lock_guard lock(m_mutex); }
+  m_published.notify_all();
+  m_released.notify_all();
+}
+
+template <typename T>
+bool broadcast_ring<T>::closed() const {
+  return m_claim.load(std::memory_order_acquire) & CLOSED;
+}
+
+template <typename T>
+bool broadcast_ring<T>::publish(const T& elem) {
+  return publish(T(elem));
+}
+
+template <typename T>
+bool broadcast_ring<T>::publish(T&& elem) {
+  auto seq = m_claim.load(std::memory_order_relaxed);
+  do {
+    if (seq & CLOSED) return false;
+  } while (!m_claim.compare_exchange_weak(seq, seq + 1,
+                                         std::memory_order_relaxed));
+  // A claimed sequence is always published, even if the ring closes, so
+  // that subscribers never wait on a hole.
+  if (!has_room(seq))
+    park(m_producers_parked, m_released, [&] { return has_room(seq); });
+  write(seq, std::move(elem));
+  return true;
+}
+
+template <typename T>
+bool broadcast_ring<T>::try_publish(T&& elem) {
+  auto seq = m_claim.load(std::memory_order_relaxed);
+  do {
+    if ((seq & CLOSED) || !has_room(seq)) return false;
+  } while (!m_claim.compare_exchange_weak(seq, seq + 1,
+                                         std::memory_order_relaxed));
+  write(seq, std::move(elem));
+  return true;
+}
+
+template <typename T>
+template <typename Handler>
+size_t broadcast_ring<T>::consume(size_t subscriber, Handler&& handler,
+                                  size_t max_n) {
+  if (max_n == 0) return 0;
+  while (true) {
+    if (const auto handled = try_consume(subscriber, handler, max_n))
+      return handled;
+    if (drained(subscriber)) return 0;
+    park(m_subscribers_parked, m_published, [this, subscriber] {
+      return readable(subscriber) || drained(subscriber);
+    });
+  }
+}
+
+template <typename T>
+template <typename Handler>
+size_t broadcast_ring<T>::try_consume(size_t subscriber, Handler&& handler,
+                                      size_t max_n) {
+  auto& next = m_cursors[subscriber].next;
+  const auto first = next.load(std::memory_order_relaxed);
+  auto seq = first;
+  for (; seq - first < max_n; ++seq) {
+    const auto& cell = m_slots[seq & m_mask];
+    if (cell.stamp.load(std::memory_order_acquire) != seq + 1) break;
+    handler(static_cast<const T&>(cell.value));
+  }
+  if (seq == first) return 0;
+  // Producers may reuse the slots once they see the new cursor.
+  next.store(seq, std::memory_order_release);
+  wake(m_producers_parked, m_released);
+  return seq - first;
+}
+
+template <typename T>
+std::optional<T> broadcast_ring<T>::receive(size_t subscriber) {
+  std::optional<T> elem;
+  consume(subscriber, [&elem](const T& value) { elem.emplace(value); }, 1);
+  return elem;
+}
@@ -0,0 +1,205 @@
+/*
+Single-threaded executor for coroutines awaiting queue operations.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+
+#include "queue_util.h"
+
+/**
+ * Coroutine return type for fire-and-forget work. The coroutine starts
+ * running at once on the calling thread and frees itself when it
+ * finishes. An exception escaping the coroutine terminates the program.
+ */
+struct detached_task {
+  struct promise_type {
+    detached_task get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+/**
+ * Executor that resumes coroutines one at a time on the thread calling
+ * run. Coroutines suspended in blocking_queue::async_pop or async_push
+ * with this executor cost no thread while they wait, so one thread can
+ * serve thousands of logical consumers. schedule may be called from any
+ * thread.
+ */
+class coroutine_scheduler {
+ private:
+  // Coroutines ready to resume, in the order they were scheduled.
+  std::deque<std::coroutine_handle<>> m_runnable;
+
+  // Whether stop has been called.
+  bool m_stopped = false;
+
+  // Synchronization primitives.
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+
+  // Threads blocked in run.
+  waiters m_runners;
+
+ public:
+  /**
+   * Awaitable returned by yield.
+   */
+  class yield_awaitable {
+   private:
+    coroutine_scheduler& m_owner;
+
+   public:
+    /**
+     * Initializes awaitable rescheduling onto owner.
+     * @param owner The scheduler to resume on.
+     */
+    explicit yield_awaitable(coroutine_scheduler& owner);
+
+    /**
+     * Always suspends.
+     * @returns False.
+     */
+    bool await_ready() const noexcept;
+
+    /**
+     * Schedules the suspended coroutine on the scheduler.
+     * @param handle The suspended coroutine.
+     */
+    void await_suspend(std::coroutine_handle<> handle);
+
+    /**
+     * Does nothing on resumption.
+     */
+    void await_resume() const noexcept;
+  };
+
+  /**
+   * Default constructor initializes scheduler with nothing to run.
+   */
+  coroutine_scheduler() = default;
+
+  /**
+   * Prevent copying construction of coroutine scheduler.
+   */
+  coroutine_scheduler(const coroutine_scheduler&) = delete;
+
+  /**
+   * Prevent assignment of coroutine scheduler.
+   */
+  coroutine_scheduler& operator=(coroutine_scheduler) = delete;
+
+  /**
+   * Queues a suspended coroutine to be resumed by run. Never resumes it
+   * before returning.
+   * @param handle The coroutine to resume.
+   */
+  void schedule(std::coroutine_handle<> handle);
+
+  /**
+   * Suspends the calling coroutine and queues it behind the coroutines
+   * already runnable. Awaiting it first moves a detached_task started on
+   * another thread onto the scheduler.
+   * @returns Awaitable that reschedules the coroutine.
+   */
+  yield_awaitable yield();
+
+  /**
+   * Resumes runnable coroutines until none is left, without blocking.
+   * @returns The number of coroutines resumed.
+   */
+  size_t run_ready();
+
+  /**
+   * Resumes coroutines as they become runnable, blocking while none is,
+   * until stop has been called and none is left.
+   */
+  void run();
+
+  /**
+   * Makes run return once no coroutine is runnable.
+   */
+  void stop();
+};
+
+inline coroutine_scheduler::yield_awaitable::yield_awaitable(
+    coroutine_scheduler& owner)
+    : m_owner(owner) {}
+
+inline bool coroutine_scheduler::yield_awaitable::await_ready()
+    const noexcept {
+  return false;
+}
+
+inline void coroutine_scheduler::yield_awaitable::await_suspend(
+    std::coroutine_handle<> handle) {
+  m_owner.schedule(handle);
+}
+
+inline void coroutine_scheduler::yield_awaitable::await_resume()
+    const noexcept {}
+
+inline void coroutine_scheduler::schedule(std::coroutine_handle<> handle) {
+  std::unique_lock lock(m_mutex);
+  m_runnable.push_back(handle);
+  const auto wakeups = m_runners.claim(1);
+  lock.unlock();
+  if (wakeups) m_ready.notify_one();
+}
+
+inline coroutine_scheduler::yield_awaitable coroutine_scheduler::yield() {
+  return yield_awaitable(*this);
+}
+
+inline size_t coroutine_scheduler::run_ready() {
+  size_t resumed = 0;
+  std::unique_lock lock(m_mutex);
+  while (!m_runnable.empty()) {
+    const auto handle = m_runnable.front();
+    m_runnable.pop_front();
+    lock.unlock();
+    handle.resume();
+    ++resumed;
+    lock.lock();
+  }
+  return resumed;
+}
+
+inline void coroutine_scheduler::run() {
+  std::unique_lock lock(m_mutex);
+  while (true) {
+    if (!m_runnable.empty()) {
+      const auto handle = m_runnable.front();
+      m_runnable.pop_front();
+      lock.unlock();
+      handle.resume();
+      lock.lock();
+    } else if (m_stopped) {
+      return;
+    } else {
+      m_runners.enter();
+      m_ready.wait(lock);
+      m_runners.wake_up();
+      m_runners.leave();
+    }
+  }
+}
+
+inline void coroutine_scheduler::stop() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_stopped = true;
+  }
+  m_ready.notify_all();
+}
+#endif
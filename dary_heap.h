@@ -0,0 +1,197 @@
+/*
+Priority container built on a d-ary heap in a contiguous buffer.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <utility>
+#include <vector>
+
+/**
+ * Priority container with the interface of std::queue, so it can serve as
+ * the Storage of blocking_queue. front is the greatest element according
+ * to Compare, as in std::priority_queue. Each node has Arity children, so
+ * the heap is shallower than a binary heap and the children compared while
+ * sifting down sit next to each other in memory. Elements of equal
+ * priority leave in an unspecified order.
+ * @tparam T The element type.
+ * @tparam Compare Strict weak ordering, where the greatest element is first.
+ * @tparam Arity The number of children per node.
+ * @tparam Allocator Allocates the element buffer.
+ */
+template <typename T, typename Compare = std::less<T>, size_t Arity = 4,
+          typename Allocator = std::allocator<T>>
+class dary_heap {
+ public:
+  using allocator_type = Allocator;
+
+ private:
+  static_assert(Arity >= 2, "heap nodes must have at least two children");
+
+  // Elements in level order. The children of i are Arity * i + 1 onwards.
+  std::vector<T, Allocator> m_heap;
+
+  // Ordering of the elements.
+  Compare m_compare;
+
+  /**
+   * Moves the element at idx up until its parent is not less than it.
+   * @param idx The index of the element.
+   */
+  void sift_up(size_t idx);
+
+  /**
+   * Moves the element at idx down until no child is greater than it.
+   * @param idx The index of the element.
+   */
+  void sift_down(size_t idx);
+
+ public:
+  /**
+   * Default constructor initializes empty heap.
+   */
+  dary_heap() = default;
+
+  /**
+   * Initializes empty heap whose buffer allocates from alloc.
+   * @param alloc The allocator to use.
+   */
+  explicit dary_heap(const Allocator& alloc);
+
+  /**
+   * Determines whether the heap is empty.
+   * @returns The heap's emptiness status.
+   */
+  bool empty() const;
+
+  /**
+   * Determines the number of elements in the heap.
+   * @returns The size of the heap.
+   */
+  size_t size() const;
+
+  /**
+   * Accesses the greatest element. The heap must be non-empty.
+   * It is mutable only so it can be moved out right before pop.
+   * @returns Reference to the greatest element.
+   */
+  T& front();
+
+  /**
+   * Copies an element into the heap.
+   * @param elem The item to insert.
+   */
+  void push(const T& elem);
+
+  /**
+   * Moves an element into the heap.
+   * @param elem The item to insert.
+   */
+  void push(T&& elem);
+
+  /**
+   * Constructs an element in place in the heap.
+   * @param args The arguments forwarded to the constructor of T.
+   */
+  template <typename... Args>
+  void emplace(Args&&... args);
+
+  /**
+   * Removes the greatest element. The heap must be non-empty.
+   */
+  void pop();
+};
+
+namespace pmr {
+
+/**
+ * D-ary heap that allocates from a std::pmr::memory_resource.
+ */
+template <typename T, typename Compare = std::less<T>, size_t Arity = 4>
+using dary_heap =
+    ::dary_heap<T, Compare, Arity, std::pmr::polymorphic_allocator<T>>;
+
+}  // namespace pmr
+
+template <typename T, typename Compare, size_t Arity, typename Allocator>
+void dary_heap<T, Compare, Arity, Allocator>::sift_up(size_t idx) {
+  // Shift parents down into the hole and place the element once.
+  T elem = std::move(m_heap[idx]);
+  while (idx > 0) {
+    const size_t parent = (idx - 1) / Arity;
+    if (!m_compare(m_heap[parent], elem)) break;
+    m_heap[idx] = std::move(m_heap[parent]);
+    idx = parent;
+  }
+  m_heap[idx] = std::move(elem);
+}
+
+template <typename T, typename Compare, size_t Arity, typename Allocator>
+void dary_heap<T, Compare, Arity, Allocator>::sift_down(size_t idx) {
+  const size_t count = m_heap.size();
+  T elem = std::move(m_heap[idx]);
+  while (true) {
+    const size_t first = Arity * idx + 1;
+    if (first >= count) break;
+    const size_t last = std::min(first + Arity, count);
+    size_t best = first;
+    for (size_t child = first + 1; child < last; ++child)
+      if (m_compare(m_heap[best], m_heap[child])) best = child;
+    if (!m_compare(elem, m_heap[best])) break;
+    m_heap[idx] = std::move(m_heap[best]);
+    idx = best;
+  }
+  m_heap[idx] = std::move(elem);
+}
+
+template <typename T, typename Compare, size_t Arity, typename Allocator>
+dary_heap<T, Compare, Arity, Allocator>::dary_heap(const Allocator& alloc)
+    : m_heap(alloc) {}
+
+template <typename T, typename Compare, size_t Arity, typename Allocator>
+bool dary_heap<T, Compare, Arity, Allocator>::empty() const {
+  return m_heap.empty();
+}
+
+template <typename T, typename Compare, size_t Arity, typename Allocator>
+size_t dary_heap<T, Compare, Arity, Allocator>::size() const {
+  return m_heap.size();
+}
+
+template <typename T, typename Compare, size_t Arity, typename Allocator>
+T& dary_heap<T, Compare, Arity, Allocator>::front() {
+  return m_heap.front();
+}
+
+template <typename T, typename Compare, size_t Arity, typename Allocator>
+void dary_heap<T, Compare, Arity, Allocator>::push(const T& elem) {
+  emplace(elem);
+}
+
+template <typename T, typename Compare, size_t Arity, typename Allocator>
+void dary_heap<T, Compare, Arity, Allocator>::push(T&& elem) {
+  emplace(std::move(elem));
+}
+
+template <typename T, typename Compare, size_t Arity, typename Allocator>
+template <typename... Args>
+void dary_heap<T, Compare, Arity, Allocator>::emplace(Args&&... args) {
+  m_heap.emplace_back(std::forward<Args>(args)...);
+  sift_up(m_heap.size() - 1);
+}
+
+template <typename T, typename Compare, size_t Arity, typename Allocator>
+void dary_heap<T, Compare, Arity, Allocator>::pop() {
+  if (m_heap.size() > 1) {
+    m_heap.front() = std::move(m_heap.back());
+    m_heap.pop_back();
+    sift_down(0);
+  } else {
+    m_heap.pop_back();
+  }
+}
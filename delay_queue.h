@@ -0,0 +1,369 @@
+/*
+Thread safe, templated queue that releases elements at scheduled times.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#include "dary_heap.h"
+#include "queue_util.h"
+
+/**
+ * Blocking queue whose elements become visible to pop only once their
+ * scheduled time has passed. Elements leave in order of their ready time,
+ * and elements with the same ready time leave in the order they were
+ * pushed. Pending elements are kept in a 4-ary heap, so push and pop take
+ * logarithmic time and no timer thread is needed.
+ *
+ * One waiting consumer, the leader, sleeps until the earliest ready time
+ * while the others sleep without a timeout. Pushing an element that
+ * becomes the earliest wakes a consumer to take over as leader, so every
+ * wakeup corresponds to an element that is due or a new earliest time.
+ * @tparam T The element type.
+ * @tparam Clock The clock measuring ready times.
+ */
+template <typename T, typename Clock = std::chrono::steady_clock>
+class delay_queue {
+ public:
+  using time_point = typename Clock::time_point;
+
+ private:
+  // Pending element with its release time.
+  struct entry {
+    time_point ready_at;
+    uint64_t seq;
+    T elem;
+  };
+
+  // Orders entries so that the earliest is at the top of the heap.
+  struct later {
+    bool operator()(const entry& lhs, const entry& rhs) const {
+      if (lhs.ready_at != rhs.ready_at) return lhs.ready_at > rhs.ready_at;
+      return lhs.seq > rhs.seq;
+    }
+  };
+
+  // Pending elements.
+  dary_heap<entry, later> m_heap;
+
+  // Number of elements ever pushed, used to break ties in FIFO order.
+  uint64_t m_pushes = 0;
+
+  // Whether close has been called.
+  bool m_closed = false;
+
+  // Consumer sleeping until the earliest ready time, if any.
+  std::thread::id m_leader;
+
+  // Synchronization primitives.
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+
+  // Consumers blocked on m_ready.
+  waiters m_consumers;
+
+  /**
+   * Waits until the earliest element is due, the queue is closed and
+   * drained, or deadline passes. The caller must hold m_mutex.
+   * @param lock The held lock on m_mutex.
+   * @param deadline The latest time to wait, or nothing to wait forever.
+   * @returns Whether the earliest element is due.
+   */
+  bool wait(std::unique_lock<std::mutex>& lock,
+            const std::optional<time_point>& deadline);
+
+  /**
+   * Removes the earliest element if wait found it due, hands the leader
+   * role to another consumer if it is vacant, and wakes every consumer
+   * once the queue is closed and drained. Releases lock.
+   * @param lock The held lock on m_mutex.
+   * @param due The result of wait.
+   * @returns The removed element, or nothing if due is false.
+   */
+  std::optional<T> finish_pop(std::unique_lock<std::mutex>& lock, bool due);
+
+  /**
+   * Inserts an element. Wakes a consumer to become leader if the
+   * element is now the earliest.
+   * @param elem The item to enqueue.
+   * @param ready_at When the element becomes visible.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool insert(T&& elem, const time_point& ready_at);
+
+  /**
+   * Converts a duration to the clock's resolution, rounding up so that
+   * elements are never released early.
+   * @param span The duration to convert.
+   * @returns The converted duration.
+   */
+  template <typename Rep, typename Period>
+  static typename Clock::duration to_duration(
+      const std::chrono::duration<Rep, Period>& span);
+
+ public:
+  /**
+   * Default constructor initializes empty queue.
+   */
+  delay_queue() = default;
+
+  /**
+   * Prevent copying construction of delay queue.
+   */
+  delay_queue(const delay_queue&) = delete;
+
+  /**
+   * Prevent assignment of delay queue.
+   */
+  delay_queue& operator=(delay_queue) = delete;
+
+  /**
+   * Determines whether the queue holds no elements, due or not,
+   * at some non-deterministic time in the future.
+   * @returns The queue's emptiness status.
+   */
+  bool empty();
+
+  /**
+   * Determines the number of elements in the queue, due or not,
+   * at some non-deterministic time in the future.
+   * @returns The size of the queue.
+   */
+  size_t size();
+
+  /**
+   * Closes the queue and wakes every blocked thread. Later pushes fail.
+   * Pending elements are still released at their ready times, and pops
+   * return nothing once the queue is drained.
+   */
+  void close();
+
+  /**
+   * Determines whether the queue has been closed.
+   * @returns The queue's closed status.
+   */
+  bool closed();
+
+  /**
+   * Schedules a copy of an element. Never blocks.
+   * @param elem The item to enqueue.
+   * @param ready_at When the element becomes visible to pop.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(const T& elem, const time_point& ready_at);
+
+  /**
+   * Schedules an element. Never blocks.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @param ready_at When the element becomes visible to pop.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(T&& elem, const time_point& ready_at);
+
+  /**
+   * Schedules a copy of an element after a delay. Never blocks.
+   * @param elem The item to enqueue.
+   * @param delay How long from now until the element becomes visible.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  template <typename Rep, typename Period>
+  bool push(const T& elem, const std::chrono::duration<Rep, Period>& delay);
+
+  /**
+   * Schedules an element after a delay. Never blocks.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @param delay How long from now until the element becomes visible.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  template <typename Rep, typename Period>
+  bool push(T&& elem, const std::chrono::duration<Rep, Period>& delay);
+
+  /**
+   * Removes and returns the earliest element, blocking until it is due.
+   * @returns The next element, or nothing if closed and drained.
+   */
+  std::optional<T> pop();
+
+  /**
+   * Removes and returns the earliest element only if it is due.
+   * @returns The next element, or nothing if none is due.
+   */
+  std::optional<T> try_pop();
+
+  /**
+   * Removes and returns the earliest element, blocking until it is due
+   * for at most timeout.
+   * @param timeout The maximum time to wait.
+   * @returns The next element, or nothing if none became due in time.
+   */
+  template <typename Rep, typename Period>
+  std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout);
+
+  /**
+   * Removes and returns the earliest element, blocking until it is due
+   * or until deadline.
+   * @param deadline The latest time to wait.
+   * @returns The next element, or nothing if none became due in time.
+   */
+  std::optional<T> pop_until(const time_point& deadline);
+};
+
+template <typename T, typename Clock>
+bool delay_queue<T, Clock>::wait(std::unique_lock<std::mutex>& lock,
+                                 const std::optional<time_point>& deadline) {
+  const auto self = std::this_thread::get_id();
+  while (true) {
+    const auto now = Clock::now();
+    if (!m_heap.empty() && m_heap.front().ready_at <= now) return true;
+    if (m_closed && m_heap.empty()) return false;
+    if (deadline && *deadline <= now) return false;
+    m_consumers.enter();
+    if (m_heap.empty() || m_leader != std::thread::id()) {
+      if (deadline)
+        m_ready.wait_until(lock, *deadline);
+      else
+        m_ready.wait(lock);
+    } else {
+      m_leader = self;
+      auto wake_at = m_heap.front().ready_at;
+      if (deadline) wake_at = std::min(wake_at, *deadline);
+      m_ready.wait_until(lock, wake_at);
+      if (m_leader == self) m_leader = std::thread::id();
+    }
+    m_consumers.wake_up();
+    m_consumers.leave();
+  }
+}
+
+template <typename T, typename Clock>
+std::optional<T> delay_queue<T, Clock>::finish_pop(
+    std::unique_lock<std::mutex>& lock, bool due) {
+  std::optional<T> elem;
+  if (due) {
+    elem.emplace(std::move(m_heap.front().elem));
+    m_heap.pop();
+  }
+  size_t wakeups = 0;
+  if (m_heap.empty()) {
+    // Waiters without a timeout must learn that the queue is drained.
+    if (m_closed) wakeups = m_consumers.claim(m_consumers.blocked);
+  } else if (m_leader == std::thread::id()) {
+    // Without a leader, nobody would wake for the next ready time.
+    wakeups = m_consumers.claim(1);
+  }
+  lock.unlock();
+  for (size_t i = 0; i < wakeups; ++i) m_ready.notify_one();
+  return elem;
+}
+
+template <typename T, typename Clock>
+bool delay_queue<T, Clock>::insert(T&& elem, const time_point& ready_at) {
+  std::unique_lock lock(m_mutex);
+  if (m_closed) return false;
+  m_heap.push(entry{ready_at, m_pushes++, std::move(elem)});
+  size_t wakeups = 0;
+  if (m_heap.front().seq == m_pushes - 1) {
+    // The leader is sleeping until a later time.
+    m_leader = std::thread::id();
+    wakeups = m_consumers.claim(1);
+  }
+  lock.unlock();
+  if (wakeups) m_ready.notify_one();
+  return true;
+}
+
+template <typename T, typename Clock>
+template <typename Rep, typename Period>
+typename Clock::duration delay_queue<T, Clock>::to_duration(
+    const std::chrono::duration<Rep, Period>& span) {
+  return std::chrono::ceil<typename Clock::duration>(span);
+}
+
+template <typename T, typename Clock>
+bool delay_queue<T, Clock>::empty() {
+  std::lock_guard lock(m_mutex);
+  return m_heap.empty();
+}
+
+template <typename T, typename Clock>
+size_t delay_queue<T, Clock>::size() {
+  std::lock_guard lock(m_mutex);
+  return m_heap.size();
+}
+
+template <typename T, typename Clock>
+void delay_queue<T, Clock>::close() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_closed = true;
+  }
+  m_ready.notify_all();
+}
+
+template <typename T, typename Clock>
+bool delay_queue<T, Clock>::closed() {
+  std::lock_guard lock(m_mutex);
+  return m_closed;
+}
+
+template <typename T, typename Clock>
+bool delay_queue<T, Clock>::push(const T& elem, const time_point& ready_at) {
+  return insert(T(elem), ready_at);
+}
+
+template <typename T, typename Clock>
+bool delay_queue<T, Clock>::push(T&& elem, const time_point& ready_at) {
+  return insert(std::move(elem), ready_at);
+}
+
+template <typename T, typename Clock>
+template <typename Rep, typename Period>
+bool delay_queue<T, Clock>::push(
+    const T& elem, const std::chrono::duration<Rep, Period>& delay) {
+  return insert(T(elem), Clock::now() + to_duration(delay));
+}
+
+template <typename T, typename Clock>
+template <typename Rep, typename Period>
+bool delay_queue<T, Clock>::push(
+    T&& elem, const std::chrono::duration<Rep, Period>& delay) {
+  return insert(std::move(elem), Clock::now() + to_duration(delay));
+}
+
+template <typename T, typename Clock>
+std::optional<T> delay_queue<T, Clock>::pop() {
+  std::unique_lock lock(m_mutex);
+  const bool due = wait(lock, std::nullopt);
+  return finish_pop(lock, due);
+}
+
+template <typename T, typename Clock>
+std::optional<T> delay_queue<T, Clock>::try_pop() {
+  std::unique_lock lock(m_mutex);
+  const bool due =
+      !m_heap.empty() && m_heap.front().ready_at <= Clock::now();
+  return finish_pop(lock, due);
+}
+
+template <typename T, typename Clock>
+template <typename Rep, typename Period>
+std::optional<T> delay_queue<T, Clock>::pop_for(
+    const std::chrono::duration<Rep, Period>& timeout) {
+  return pop_until(Clock::now() + to_duration(timeout));
+}
+
+template <typename T, typename Clock>
+std::optional<T> delay_queue<T, Clock>::pop_until(
+    const time_point& deadline) {
+  std::unique_lock lock(m_mutex);
+  const bool due = wait(lock, deadline);
+  return finish_pop(lock, due);
+}
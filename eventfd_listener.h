@@ -0,0 +1,116 @@
+/*
+Queue listener that signals a Linux eventfd for use with epoll.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <system_error>
+
+#include "queue_listener.h"
+
+/**
+ * Listener that makes queue readiness visible to poll, select and epoll.
+ * Subscribe it to one or more queues and add fd() to an epoll set. The
+ * descriptor becomes readable when a subscribed queue goes from empty to
+ * non-empty or is closed. The key is ignored, so a listener shared by
+ * several queues only says that one of them may be ready.
+ *
+ * Writes are coalesced: after the first notification, further ones make
+ * no system call until consume is called. A burst of pushes therefore
+ * costs at most one write. Once the descriptor is readable, call consume
+ * and then drain the queues with try_pop until they are empty. Pushes
+ * that race with the drain make the descriptor readable again.
+ * Available on Linux only.
+ */
+class eventfd_listener : public queue_listener {
+ private:
+  // Non-blocking eventfd counter.
+  const int m_fd;
+
+  // Whether the counter has been written since the last consume.
+  std::atomic<bool> m_signaled{false};
+
+ public:
+  /**
+   * Creates the eventfd.
+   * @throws std::system_error if the descriptor cannot be created.
+   */
+  eventfd_listener();
+
+  /**
+   * Closes the eventfd. The listener must be unsubscribed from every queue.
+   */
+  ~eventfd_listener() override;
+
+  /**
+   * Prevent copying construction of eventfd listener.
+   */
+  eventfd_listener(const eventfd_listener&) = delete;
+
+  /**
+   * Prevent assignment of eventfd listener.
+   */
+  eventfd_listener& operator=(eventfd_listener) = delete;
+
+  /**
+   * Returns the descriptor to register with poll, select or epoll.
+   * It is non-blocking and closed on exec.
+   * @returns The eventfd.
+   */
+  int fd() const;
+
+  /**
+   * Makes the descriptor readable unless it already is.
+   * @param key Ignored.
+   */
+  void notify(size_t key) noexcept override;
+
+  /**
+   * Rearms the listener and makes the descriptor unreadable until the
+   * next notification. Call before draining the subscribed queues.
+   * @returns Whether a notification was pending.
+   */
+  bool consume();
+};
+
+inline eventfd_listener::eventfd_listener()
+    : m_fd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+  if (m_fd < 0)
+    throw std::system_error(errno, std::generic_category(), "eventfd");
+}
+
+inline eventfd_listener::~eventfd_listener() {
+  ::close(m_fd);
+}
+
+inline int eventfd_listener::fd() const {
+  return m_fd;
+}
+
+inline void eventfd_listener::notify(size_t) noexcept {
+  if (m_signaled.exchange(true, std::memory_order_acq_rel)) return;
+  const uint64_t one = 1;
+  while (::write(m_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+  }
+}
+
+inline bool eventfd_listener::consume() {
+  // Read before clearing the flag. Clearing first would let a
+  // notification write between the two steps, have its count absorbed by
+  // this read and leave the flag set, so no later notification would
+  // write again. A notification that instead sees the flag still set and
+  // skips its write came from a push the caller's drain will find.
+  uint64_t count = 0;
+  ssize_t result;
+  do {
+    result = ::read(m_fd, &count, sizeof(count));
+  } while (result < 0 && errno == EINTR);
+  m_signaled.store(false, std::memory_order_seq_cst);
+  return result == static_cast<ssize_t>(sizeof(count));
+}
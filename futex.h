@@ -0,0 +1,161 @@
+/*
+A 32-bit word that threads can sleep on until its value changes.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <atomic>
+#include <cstdint>
+#if __has_include(<version>)
+#include <version>
+#endif
+
+#if defined(__cpp_lib_atomic_wait)
+// C++20 atomic waiting, which the standard library maps onto futexes.
+#define FUTEX_WORD_ATOMIC_WAIT 1
+#elif defined(__linux__)
+#define FUTEX_WORD_LINUX 1
+#endif
+
+#if defined(FUTEX_WORD_LINUX)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif !defined(FUTEX_WORD_ATOMIC_WAIT)
+#include <condition_variable>
+#include <mutex>
+#endif
+
+/**
+ * Atomic 32-bit word with futex-style wait and wake operations.
+ * The backend is selected at compile time. With C++20, it uses
+ * std::atomic::wait and notify. Otherwise on Linux, waiters sleep in the
+ * kernel directly on the word's address, so a wakeup costs one system call
+ * and no user-space lock. Elsewhere, it falls back to a private mutex and
+ * condition variable.
+ */
+class futex_word {
+ private:
+  std::atomic<uint32_t> m_value;
+
+#if !defined(FUTEX_WORD_ATOMIC_WAIT) && !defined(FUTEX_WORD_LINUX)
+  // Fallback synchronization for platforms without futexes.
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+#endif
+
+ public:
+  /**
+   * Initializes the word.
+   * @param value The initial value.
+   */
+  explicit futex_word(uint32_t value = 0);
+
+  /**
+   * Prevent copying construction of futex word.
+   */
+  futex_word(const futex_word&) = delete;
+
+  /**
+   * Prevent assignment of futex word.
+   */
+  futex_word& operator=(futex_word) = delete;
+
+  /**
+   * Reads the word.
+   * @param order The memory order of the load.
+   * @returns The current value.
+   */
+  uint32_t load(std::memory_order order = std::memory_order_seq_cst) const;
+
+  /**
+   * Writes the word. Does not wake any waiter.
+   * @param value The new value.
+   * @param order The memory order of the store.
+   */
+  void store(uint32_t value,
+             std::memory_order order = std::memory_order_seq_cst);
+
+  /**
+   * Sleeps while the word holds expected. May return spuriously, so
+   * callers must recheck their condition.
+   * @param expected The value the caller last observed.
+   */
+  void wait(uint32_t expected);
+
+  /**
+   * Wakes one thread sleeping in wait.
+   */
+  void wake_one();
+
+  /**
+   * Wakes every thread sleeping in wait.
+   */
+  void wake_all();
+};
+
+inline futex_word::futex_word(uint32_t value) : m_value(value) {}
+
+inline uint32_t futex_word::load(std::memory_order order) const {
+  return m_value.load(order);
+}
+
+inline void futex_word::store(uint32_t value, std::memory_order order) {
+  m_value.store(value, order);
+}
+
+#if defined(FUTEX_WORD_ATOMIC_WAIT)
+
+inline void futex_word::wait(uint32_t expected) {
+  m_value.wait(expected, std::memory_order_acquire);
+}
+
+inline void futex_word::wake_one() {
+  m_value.notify_one();
+}
+
+inline void futex_word::wake_all() {
+  m_value.notify_all();
+}
+
+#elif defined(FUTEX_WORD_LINUX)
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) &&
+                  std::atomic<uint32_t>::is_always_lock_free,
+              "futex_word requires a plain 32-bit atomic");
+
+inline void futex_word::wait(uint32_t expected) {
+  // The kernel compares the word with expected before sleeping, so a
+  // change made before this call is never missed.
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_value),
+          FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+inline void futex_word::wake_one() {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_value),
+          FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+inline void futex_word::wake_all() {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_value),
+          FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+#else
+
+inline void futex_word::wait(uint32_t expected) {
+  std::unique_lock lock(m_mutex);
+  m_cv.wait(lock, [&] { return load() != expected; });
+}
+
+inline void futex_word::wake_one() {
+  { std::lock_guard lock(m_mutex); }
+  m_cv.notify_one();
+}
+
+inline void futex_word::wake_all() {
+  { std::lock_guard lock(m_mutex); }
+  m_cv.notify_all();
+}
+
+#endif
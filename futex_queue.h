@@ -0,0 +1,306 @@
+/*
+Thread safe, templated, blocking queue that parks threads on futex words.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+
+#include "futex.h"
+#include "queue_util.h"
+
+/**
+ * Blocking queue with the monitor semantics of blocking_queue that parks
+ * blocked threads on futex words instead of condition variables.
+ * Every push bumps a sequence word that consumers sleep on, and every pop
+ * bumps one that producers sleep on, so a wakeup is a single futex call
+ * with no condition variable bookkeeping. Only the wait backend differs
+ * from blocking_queue: the elements are still guarded by a std::mutex,
+ * which a woken thread re-acquires before it pops or pushes, so an
+ * uncontended handoff costs about the same as in blocking_queue.
+ */
+template <typename T>
+class futex_queue {
+ private:
+  // Internal queue.
+  std::queue<T> m_queue;
+
+  // Maximum number of elements held at once.
+  const size_t m_capacity;
+
+  // Whether close has been called.
+  bool m_closed = false;
+
+  // Protects the internal queue and closed flag.
+  std::mutex m_mutex;
+
+  // Sequence words bumped by every push and every pop, under m_mutex.
+  futex_word m_pushes;
+  futex_word m_pops;
+
+  // Threads sleeping on each sequence word, guarded by m_mutex.
+  waiters m_consumers;
+  waiters m_producers;
+
+  /**
+   * Advances a sequence word. The caller must hold m_mutex.
+   * @param word The sequence word to bump.
+   */
+  static void bump(futex_word& word);
+
+  /**
+   * Sleeps on word until it is next bumped. The caller must hold
+   * m_mutex through lock, which is released while sleeping.
+   * @param lock The held lock on m_mutex.
+   * @param word The sequence word to sleep on.
+   * @param sleeping The threads sleeping on word.
+   */
+  static void sleep(std::unique_lock<std::mutex>& lock, futex_word& word,
+                    waiters& sleeping);
+
+ public:
+  /**
+   * Capacity of a queue that never blocks producers.
+   */
+  static constexpr size_t UNBOUNDED = std::numeric_limits<size_t>::max();
+
+  /**
+   * Default constructor initializes empty, unbounded queue.
+   */
+  futex_queue();
+
+  /**
+   * Initializes empty queue holding at most capacity elements.
+   * @param capacity The maximum number of elements. Must be positive.
+   */
+  explicit futex_queue(size_t capacity);
+
+  /**
+   * Prevent copying construction of futex queue.
+   */
+  futex_queue(const futex_queue<T>&) = delete;
+
+  /**
+   * Prevent assignment of futex queue.
+   */
+  futex_queue<T>& operator=(futex_queue<T>) = delete;
+
+  /**
+   * Determines whether the queue is empty
+   * at some non-deterministic time in the future.
+   * @returns The queue's emptiness status.
+   */
+  bool empty();
+
+  /**
+   * Determines the number of elements in the queue
+   * at some non-deterministic time in the future.
+   * @returns The size of the queue.
+   */
+  size_t size();
+
+  /**
+   * Returns the maximum number of elements the queue holds.
+   * @returns The capacity, or UNBOUNDED.
+   */
+  size_t capacity() const;
+
+  /**
+   * Closes the queue and wakes every sleeping thread. Later pushes fail
+   * and pops return nothing once the remaining elements are drained.
+   */
+  void close();
+
+  /**
+   * Determines whether the queue has been closed.
+   * @returns The queue's closed status.
+   */
+  bool closed();
+
+  /**
+   * Pushes an element onto the queue, blocking while it is full.
+   * @param elem The item to enqueue.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(const T& elem);
+
+  /**
+   * Moves an element onto the queue, blocking while it is full.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(T&& elem);
+
+  /**
+   * Constructs an element from args and pushes it, blocking if needed.
+   * @param args The arguments forwarded to the constructor of T.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  template <typename... Args>
+  bool emplace(Args&&... args);
+
+  /**
+   * Pushes an element onto the queue only if it is not full or closed.
+   * @param elem The item to enqueue.
+   * @returns Whether the element was enqueued.
+   */
+  bool try_push(const T& elem);
+
+  /**
+   * Moves an element onto the queue only if it is not full or closed.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @returns Whether the element was enqueued.
+   */
+  bool try_push(T&& elem);
+
+  /**
+   * Removes and returns an element, blocking while the queue is empty.
+   * @returns The next element, or nothing if closed and drained.
+   */
+  std::optional<T> pop();
+
+  /**
+   * Removes and returns an element only if one is available.
+   * @returns The next element, or nothing if the queue is empty.
+   */
+  std::optional<T> try_pop();
+};
+
+template <typename T>
+void futex_queue<T>::bump(futex_word& word) {
+  word.store(word.load(std::memory_order_relaxed) + 1,
+             std::memory_order_release);
+}
+
+template <typename T>
+void futex_queue<T>::sleep(std::unique_lock<std::mutex>& lock,
+                           futex_word& word, waiters& sleeping) {
+  // Bumps happen under m_mutex, so any bump after this load makes the
+  // kernel refuse to sleep. The woken thread must still take m_mutex
+  // again to touch the queue.
+  const auto observed = word.load(std::memory_order_relaxed);
+  sleeping.enter();
+  lock.unlock();
+  word.wait(observed);
+  lock.lock();
+  sleeping.wake_up();
+  sleeping.leave();
+}
+
+template <typename T>
+futex_queue<T>::futex_queue() : futex_queue(UNBOUNDED) {}
+
+template <typename T>
+futex_queue<T>::futex_queue(size_t capacity) : m_capacity(capacity) {
+  if (capacity == 0)
+    throw std::invalid_argument("futex_queue capacity must be positive");
+}
+
+template <typename T>
+bool futex_queue<T>::empty() {
+  std::lock_guard lock(m_mutex);
+  return m_queue.empty();
+}
+
+template <typename T>
+size_t futex_queue<T>::size() {
+  std::lock_guard lock(m_mutex);
+  return m_queue.size();
+}
+
+template <typename T>
+size_t futex_queue<T>::capacity() const {
+  return m_capacity;
+}
+
+template <typename T>
+void futex_queue<T>::close() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_closed = true;
+    bump(m_pushes);
+    bump(m_pops);
+  }
+  m_pushes.wake_all();
+  m_pops.wake_all();
+}
+
+template <typename T>
+bool futex_queue<T>::closed() {
+  std::lock_guard lock(m_mutex);
+  return m_closed;
+}
+
+template <typename T>
+bool futex_queue<T>::push(const T& elem) {
+  return push(T(elem));
+}
+
+template <typename T>
+bool futex_queue<T>::push(T&& elem) {
+  std::unique_lock lock(m_mutex);
+  while (!m_closed && m_queue.size() >= m_capacity)
+    sleep(lock, m_pops, m_producers);
+  if (m_closed) return false;
+  m_queue.push(std::move(elem));
+  bump(m_pushes);
+  const auto wakeup = m_consumers.claim(1);
+  lock.unlock();
+  if (wakeup) m_pushes.wake_one();
+  return true;
+}
+
+template <typename T>
+template <typename... Args>
+bool futex_queue<T>::emplace(Args&&... args) {
+  return push(T(std::forward<Args>(args)...));
+}
+
+template <typename T>
+bool futex_queue<T>::try_push(const T& elem) {
+  return try_push(T(elem));
+}
+
+template <typename T>
+bool futex_queue<T>::try_push(T&& elem) {
+  std::unique_lock lock(m_mutex);
+  if (m_closed || m_queue.size() >= m_capacity) return false;
+  m_queue.push(std::move(elem));
+  bump(m_pushes);
+  const auto wakeup = m_consumers.claim(1);
+  lock.unlock();
+  if (wakeup) m_pushes.wake_one();
+  return true;
+}
+
+template <typename T>
+std::optional<T> futex_queue<T>::pop() {
+  std::unique_lock lock(m_mutex);
+  while (!m_closed && m_queue.empty()) sleep(lock, m_pushes, m_consumers);
+  if (m_queue.empty()) return std::nullopt;
+  std::optional<T> elem(std::move(m_queue.front()));
+  m_queue.pop();
+  bump(m_pops);
+  const auto wakeup = m_producers.claim(1);
+  lock.unlock();
+  if (wakeup) m_pops.wake_one();
+  return elem;
+}
+
+template <typename T>
+std::optional<T> futex_queue<T>::try_pop() {
+  std::unique_lock lock(m_mutex);
+  if (m_queue.empty()) return std::nullopt;
+  std::optional<T> elem(std::move(m_queue.front()));
+  m_queue.pop();
+  bump(m_pops);
+  const auto wakeup = m_producers.claim(1);
+  lock.unlock();
+  if (wakeup) m_pops.wake_one();
+  return elem;
+}
@@ -0,0 +1,556 @@
+/*
+Lock-free, unbounded, multi-producer, multi-consumer linked list queue.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "queue_util.h"
+
+/**
+ * Unbounded Michael-Scott queue for any number of producer and consumer
+ * threads. Dequeued nodes are reclaimed with hazard pointers and recycled
+ * through node pools kept in the hazard records, so steady-state pushes do
+ * not call new. Each operation claims an idle record by scanning the
+ * record list, which grows to the peak number of concurrent operations.
+ * Threads park on a condition variable only when the queue is empty.
+ */
+template <typename T>
+class lockfree_queue {
+ private:
+  // Linked list node. The head node is a dummy whose value is not alive.
+  struct node {
+    std::atomic<node*> next{nullptr};
+    alignas(T) unsigned char bytes[sizeof(T)];
+  };
+
+  // Hazard pointers and node caches owned by one thread at a time.
+  struct hazard_record {
+    std::atomic<node*> hazards[2] = {nullptr, nullptr};
+    std::atomic<bool> active{true};
+    hazard_record* next = nullptr;
+    std::vector<node*> retired;
+    std::vector<node*> scratch;
+    node* pool = nullptr;
+    size_t pool_size = 0;
+  };
+
+  /**
+   * Exclusive ownership of a hazard record for one operation.
+   */
+  class record_guard {
+   private:
+    hazard_record* m_record;
+
+   public:
+    explicit record_guard(lockfree_queue<T>& queue);
+    ~record_guard();
+    record_guard(const record_guard&) = delete;
+    record_guard& operator=(record_guard) = delete;
+    hazard_record* operator->() const { return m_record; }
+    hazard_record& operator*() const { return *m_record; }
+  };
+
+  // Number of nodes moved between a record and the shared pool at once.
+  static constexpr size_t POOL_BATCH = 64;
+
+  // Bit of m_state set once the queue is closed, and the amount each
+  // push in progress adds to it.
+  static constexpr size_t CLOSED = 1;
+  static constexpr size_t PUSHER = 2;
+
+  // Ends of the linked list.
+  alignas(CACHE_LINE) std::atomic<node*> m_head;
+  alignas(CACHE_LINE) std::atomic<node*> m_tail;
+
+  // Approximate number of elements, used for size and parking. Counted
+  // after linking, so it is briefly negative when a consumer pops a node
+  // before its producer has counted it.
+  alignas(CACHE_LINE) std::atomic<std::ptrdiff_t> m_size{0};
+
+  // Closed bit plus PUSHER for each push between its closed check and
+  // its link, so consumers can wait for pushes that raced with close.
+  std::atomic<size_t> m_state{0};
+
+  // Hazard records, only ever prepended to.
+  std::atomic<hazard_record*> m_records{nullptr};
+  std::atomic<size_t> m_record_count{0};
+
+  // Batches of free nodes shared between records.
+  std::mutex m_pool_mutex;
+  std::vector<node*> m_pool_batches;
+
+  // Parking fallback, only touched when the queue is empty.
+  std::atomic<size_t> m_waiting_consumers{0};
+  std::mutex m_mutex;
+  std::condition_variable m_not_empty;
+
+  /**
+   * Returns the value storage of a node.
+   * @param ptr The node holding the value.
+   * @returns Pointer to the node's value.
+   */
+  static T* element(node* ptr);
+
+  /**
+   * Claims an inactive hazard record, allocating one if all are in use.
+   * @returns The claimed record.
+   */
+  hazard_record* acquire_record();
+
+  /**
+   * Publishes a hazard pointer to the node currently stored in src.
+   * @param record The calling thread's record.
+   * @param idx The hazard pointer slot to use.
+   * @param src The atomic pointer to read.
+   * @returns The protected node.
+   */
+  static node* protect(hazard_record& record, size_t idx,
+                       const std::atomic<node*>& src);
+
+  /**
+   * Takes a node from the record's pool, refilling it from the shared
+   * pool or the allocator when empty.
+   * @param record The calling thread's record.
+   * @returns An unlinked node without a live value.
+   */
+  node* allocate(hazard_record& record);
+
+  /**
+   * Returns a node to the record's pool, spilling a batch to the shared
+   * pool when the record holds too many.
+   * @param record The calling thread's record.
+   * @param ptr The node to recycle.
+   */
+  void recycle(hazard_record& record, node* ptr);
+
+  /**
+   * Defers recycling of a dequeued node until no hazard pointer holds it.
+   * @param record The calling thread's record.
+   * @param ptr The node removed from the list.
+   */
+  void retire(hazard_record& record, node* ptr);
+
+  /**
+   * Recycles every retired node of the record that is not hazardous.
+   * @param record The calling thread's record.
+   */
+  void scan(hazard_record& record);
+
+  /**
+   * Links a node holding a live value onto the tail.
+   * @param record The calling thread's record.
+   * @param ptr The node to link.
+   */
+  void enqueue(hazard_record& record, node* ptr);
+
+  /**
+   * Wakes one parked consumer if any announced that it is about to park.
+   */
+  void wake();
+
+ public:
+  /**
+   * Default constructor initializes empty queue.
+   */
+  lockfree_queue();
+
+  /**
+   * Destroys remaining elements and frees every node.
+   */
+  ~lockfree_queue();
+
+  /**
+   * Prevent copying construction of lockfree queue.
+   */
+  lockfree_queue(const lockfree_queue<T>&) = delete;
+
+  /**
+   * Prevent assignment of lockfree queue.
+   */
+  lockfree_queue<T>& operator=(lockfree_queue<T>) = delete;
+
+  /**
+   * Determines whether the queue is empty
+   * at some non-deterministic time in the future.
+   * @returns The queue's emptiness status.
+   */
+  bool empty() const;
+
+  /**
+   * Approximates the number of elements in the queue.
+   * @returns The size of the queue.
+   */
+  size_t size() const;
+
+  /**
+   * Closes the queue and wakes every parked thread. Later pushes fail
+   * and pops return nothing once the remaining elements are drained.
+   */
+  void close();
+
+  /**
+   * Determines whether the queue has been closed.
+   * @returns The queue's closed status.
+   */
+  bool closed() const;
+
+  /**
+   * Pushes an element onto the queue. Never blocks.
+   * @param elem The item to enqueue.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(const T& elem);
+
+  /**
+   * Moves an element onto the queue. Never blocks.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(T&& elem);
+
+  /**
+   * Constructs an element from args and pushes it. Never blocks.
+   * @param args The arguments forwarded to the constructor of T.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  template <typename... Args>
+  bool emplace(Args&&... args);
+
+  /**
+   * Removes and returns an element, blocking while the queue is empty.
+   * @returns The next element, or nothing if closed and drained.
+   */
+  std::optional<T> pop();
+
+  /**
+   * Removes and returns an element only if one is available.
+   * @returns The next element, or nothing if the queue is empty.
+   */
+  std::optional<T> try_pop();
+
+  /**
+   * Removes and returns an element, blocking for at most timeout.
+   * @param timeout The longest time to wait for an element.
+   * @returns The next element, or nothing if the timeout expired
+   *          or the queue is closed and drained.
+   */
+  template <typename Rep, typename Period>
+  std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout);
+
+  /**
+   * Removes and returns an element, blocking until at most deadline.
+   * @param deadline The latest time to wait for an element.
+   * @returns The next element, or nothing if the deadline passed
+   *          or the queue is closed and drained.
+   */
+  template <typename Clock, typename Duration>
+  std::optional<T> pop_until(
+      const std::chrono::time_point<Clock, Duration>& deadline);
+};
+
+template <typename T>
+lockfree_queue<T>::record_guard::record_guard(lockfree_queue<T>& queue)
+    : m_record(queue.acquire_record()) {}
+
+template <typename T>
+lockfree_queue<T>::record_guard::~record_guard() {
+  m_record->hazards[0].store(nullptr, std::memory_order_release);
+  m_record->hazards[1].store(nullptr, std::memory_order_release);
+  m_record->active.store(false, std::memory_order_release);
+}
+
+template <typename T>
+T* lockfree_queue<T>::element(node* ptr) {
+  return std::launder(reinterpret_cast<T*>(ptr->bytes));
+}
+
+template <typename T>
+typename lockfree_queue<T>::hazard_record* lockfree_queue<T>::acquire_record() {
+  for (auto* record = m_records.load(std::memory_order_acquire); record;
+       record = record->next) {
+    if (!record->active.load(std::memory_order_relaxed) &&
+        !record->active.exchange(true, std::memory_order_acquire))
+      return record;
+  }
+  auto* record = new hazard_record;
+  record->next = m_records.load(std::memory_order_relaxed);
+  while (!m_records.compare_exchange_weak(record->next, record,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed))
+    continue;
+  m_record_count.fetch_add(1, std::memory_order_relaxed);
+  return record;
+}
+
+template <typename T>
+typename lockfree_queue<T>::node* lockfree_queue<T>::protect(
+    hazard_record& record, size_t idx, const std::atomic<node*>& src) {
+  auto* ptr = src.load(std::memory_order_relaxed);
+  while (true) {
+    record.hazards[idx].store(ptr, std::memory_order_seq_cst);
+    auto* current = src.load(std::memory_order_seq_cst);
+    if (current == ptr) return ptr;
+    ptr = current;
+  }
+}
+
+template <typename T>
+typename lockfree_queue<T>::node* lockfree_queue<T>::allocate(
+    hazard_record& record) {
+  if (!record.pool) {
+    std::lock_guard lock(m_pool_mutex);
+    if (!m_pool_batches.empty()) {
+      record.pool = m_pool_batches.back();
+      record.pool_size = POOL_BATCH;
+      m_pool_batches.pop_back();
+    }
+  }
+  if (!record.pool) return new node;
+  auto* ptr = record.pool;
+  record.pool = ptr->next.load(std::memory_order_relaxed);
+  --record.pool_size;
+  ptr->next.store(nullptr, std::memory_order_relaxed);
+  return ptr;
+}
+
+template <typename T>
+void lockfree_queue<T>::recycle(hazard_record& record, node* ptr) {
+  ptr->next.store(record.pool, std::memory_order_relaxed);
+  record.pool = ptr;
+  if (++record.pool_size < 2 * POOL_BATCH) return;
+  // Detach exactly one batch from the front and share it.
+  auto* last = record.pool;
+  for (size_t i = 1; i < POOL_BATCH; ++i)
+    last = last->next.load(std::memory_order_relaxed);
+  auto* batch = record.pool;
+  record.pool = last->next.load(std::memory_order_relaxed);
+  record.pool_size -= POOL_BATCH;
+  last->next.store(nullptr, std::memory_order_relaxed);
+  std::lock_guard lock(m_pool_mutex);
+  m_pool_batches.push_back(batch);
+}
+
+template <typename T>
+void lockfree_queue<T>::retire(hazard_record& record, node* ptr) {
+  record.retired.push_back(ptr);
+  const auto threshold = std::max<size_t>(
+      POOL_BATCH, 4 * m_record_count.load(std::memory_order_relaxed));
+  if (record.retired.size() >= threshold) scan(record);
+}
+
+template <typename T>
+void lockfree_queue<T>::scan(hazard_record& record) {
+  auto& hazards = record.scratch;
+  hazards.clear();
+  for (auto* other = m_records.load(std::memory_order_acquire); other;
+       other = other->next) {
+    for (const auto& hazard : other->hazards) {
+      auto* ptr = hazard.load(std::memory_order_seq_cst);
+      if (ptr) hazards.push_back(ptr);
+    }
+  }
+  std::sort(hazards.begin(), hazards.end());
+  size_t kept = 0;
+  for (auto* ptr : record.retired) {
+    if (std::binary_search(hazards.begin(), hazards.end(), ptr))
+      record.retired[kept++] = ptr;
+    else
+      recycle(record, ptr);
+  }
+  record.retired.resize(kept);
+}
+
+template <typename T>
+void lockfree_queue<T>::enqueue(hazard_record& record, node* ptr) {
+  while (true) {
+    auto* tail = protect(record, 0, m_tail);
+    auto* next = tail->next.load(std::memory_order_acquire);
+    if (tail != m_tail.load(std::memory_order_acquire)) continue;
+    if (next) {
+      // Help a lagging producer swing the tail forward.
+      m_tail.compare_exchange_weak(tail, next, std::memory_order_release,
+                                   std::memory_order_relaxed);
+      continue;
+    }
+    if (tail->next.compare_exchange_weak(next, ptr, std::memory_order_release,
+                                         std::memory_order_relaxed)) {
+      m_tail.compare_exchange_strong(tail, ptr, std::memory_order_release,
+                                     std::memory_order_relaxed);
+      return;
+    }
+  }
+}
+
+template <typename T>
+void lockfree_queue<T>::wake() {
+  // Pairs with the fence in pop_until: either the parking thread sees the
+  // new size, or we see its announcement and notify it.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_waiting_consumers.load(std::memory_order_relaxed) == 0) return;
+  { std::lock_guard lock(m_mutex); }
+  m_not_empty.notify_one();
+}
+
+template <typename T>
+lockfree_queue<T>::lockfree_queue() : m_head(new node), m_tail(m_head.load()) {}
+
+template <typename T>
+lockfree_queue<T>::~lockfree_queue() {
+  auto* ptr = m_head.load(std::memory_order_relaxed);
+  auto* next = ptr->next.load(std::memory_order_relaxed);
+  delete ptr;
+  for (ptr = next; ptr; ptr = next) {
+    next = ptr->next.load(std::memory_order_relaxed);
+    element(ptr)->~T();
+    delete ptr;
+  }
+  auto delete_list = [](node* list) {
+    while (list) {
+      auto* following = list->next.load(std::memory_order_relaxed);
+      delete list;
+      list = following;
+    }
+  };
+  for (auto* batch : m_pool_batches) delete_list(batch);
+  auto* record = m_records.load(std::memory_order_relaxed);
+  while (record) {
+    for (auto* retired : record->retired) delete retired;
+    delete_list(record->pool);
+    auto* following = record->next;
+    delete record;
+    record = following;
+  }
+}
+
+template <typename T>
+bool lockfree_queue<T>::empty() const {
+  return size() == 0;
+}
+
+template <typename T>
+size_t lockfree_queue<T>::size() const {
+  const auto size = m_size.load(std::memory_order_acquire);
+  return size > 0 ? static_cast<size_t>(size) : 0;
+}
+
+template <typename T>
+void lockfree_queue<T>::close() {
+  m_state.fetch_or(CLOSED, std::memory_order_acq_rel);
+  { std::lock_guard lock(m_mutex); }
+  m_not_empty.notify_all();
+}
+
+template <typename T>
+bool lockfree_queue<T>::closed() const {
+  return (m_state.load(std::memory_order_acquire) & CLOSED) != 0;
+}
+
+template <typename T>
+bool lockfree_queue<T>::push(const T& elem) {
+  return push(T(elem));
+}
+
+template <typename T>
+bool lockfree_queue<T>::push(T&& elem) {
+  // Announce the push and check for close in one step, so close either
+  // fails the push or lets consumers see it in progress.
+  if (m_state.fetch_add(PUSHER, std::memory_order_acquire) & CLOSED) {
+    m_state.fetch_sub(PUSHER, std::memory_order_relaxed);
+    return false;
+  }
+  {
+    record_guard record(*this);
+    auto* ptr = allocate(*record);
+    new (ptr->bytes) T(std::move(elem));
+    enqueue(*record, ptr);
+  }
+  // Count after linking, so that a consumer woken by the count finds it.
+  m_size.fetch_add(1, std::memory_order_relaxed);
+  m_state.fetch_sub(PUSHER, std::memory_order_release);
+  wake();
+  return true;
+}
+
+template <typename T>
+template <typename... Args>
+bool lockfree_queue<T>::emplace(Args&&... args) {
+  return push(T(std::forward<Args>(args)...));
+}
+
+template <typename T>
+std::optional<T> lockfree_queue<T>::pop() {
+  return pop_until(std::chrono::steady_clock::time_point::max());
+}
+
+template <typename T>
+std::optional<T> lockfree_queue<T>::try_pop() {
+  record_guard record(*this);
+  while (true) {
+    auto* head = protect(*record, 0, m_head);
+    auto* tail = m_tail.load(std::memory_order_acquire);
+    auto* next = head->next.load(std::memory_order_acquire);
+    record->hazards[1].store(next, std::memory_order_seq_cst);
+    // Once head is confirmed current, next cannot have been retired.
+    if (head != m_head.load(std::memory_order_seq_cst)) continue;
+    if (!next) return std::nullopt;
+    if (head == tail) {
+      m_tail.compare_exchange_weak(tail, next, std::memory_order_release,
+                                   std::memory_order_relaxed);
+      continue;
+    }
+    if (m_head.compare_exchange_weak(head, next, std::memory_order_acq_rel,
+                                     std::memory_order_relaxed)) {
+      // Next is the new dummy; its value belongs to us alone.
+      std::optional<T> elem(std::move(*element(next)));
+      element(next)->~T();
+      m_size.fetch_sub(1, std::memory_order_relaxed);
+      record->hazards[0].store(nullptr, std::memory_order_release);
+      retire(*record, head);
+      return elem;
+    }
+  }
+}
+
+template <typename T>
+template <typename Rep, typename Period>
+std::optional<T> lockfree_queue<T>::pop_for(
+    const std::chrono::duration<Rep, Period>& timeout) {
+  return pop_until(std::chrono::steady_clock::now() + timeout);
+}
+
+template <typename T>
+template <typename Clock, typename Duration>
+std::optional<T> lockfree_queue<T>::pop_until(
+    const std::chrono::time_point<Clock, Duration>& deadline) {
+  while (true) {
+    if (auto elem = try_pop()) return elem;
+    const auto state = m_state.load(std::memory_order_acquire);
+    if (state == CLOSED) return try_pop();
+    if (state & CLOSED) {
+      // A push that started before close is still linking its node.
+      std::this_thread::yield();
+      continue;
+    }
+    std::unique_lock lock(m_mutex);
+    m_waiting_consumers.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const bool ready = m_not_empty.wait_until(lock, deadline, [this] {
+      return closed() || m_size.load(std::memory_order_relaxed) > 0;
+    });
+    m_waiting_consumers.fetch_sub(1, std::memory_order_relaxed);
+    lock.unlock();
+    if (!ready) return try_pop();
+  }
+}
@@ -4,17 +4,30 @@ sequential and fully parallel workloads.
 
 Copyright 2021. Andrew Wang.
 */
+#include <sys/resource.h>
+
 #include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <cmath>
 #include <iostream>
+#include <memory_resource>
+#include <optional>
 #include <random>
 #include <thread>
 #include <utility>
 #include <vector>
 
 #include "blocking_queue.h"
+#include "broadcast_ring.h"
+#include "futex_queue.h"
+#include "lockfree_queue.h"
+#include "mpmc_queue.h"
+#include "pipeline.h"
+#include "segmented_queue.h"
+#include "sharded_queue.h"
+#include "thread_pool.h"
+#include "work_stealing_pool.h"
 using std::accumulate;
 using std::atomic;
 using std::cout;
@@ -47,14 +60,75 @@ void report_accuracy(uint64_t in_circle, uint64_t total);
 void report_time(nanoseconds dur);
 
 /**
- * Run the monitor part of the experiment using blocking_queue.
+ * Run the monitor part of the experiment using a thread safe queue.
+ * @param points The queue that carries points to consumers.
+ * @param name The name of the queue type reported to std::cout.
  * @param threads_per_type Number of producers and consumers each.
  * @param points_per_thread Number of points processed per thread.
  * @param sleep_ns Number of ns to sleep between each point.
  */
-void execute_monitor(uint64_t threads_per_type, uint64_t points_per_thread,
+template <typename Queue>
+void execute_monitor(Queue& points, const char* name,
+                     uint64_t threads_per_type, uint64_t points_per_thread,
                      uint64_t sleep_ns);
 
+/**
+ * Measure the cost of passing points through a queue without extra work.
+ * One producer pushes every point while one consumer pops them. Reports
+ * the context switches per point, since every one that is voluntary is a
+ * thread that parked in a system call and had to be woken by another.
+ * @param points The queue that carries points to the consumer.
+ * @param name The name of the queue type reported to std::cout.
+ * @param total_points Number of points passed through the queue.
+ */
+template <typename Queue>
+void execute_handoff(Queue& points, const char* name, uint64_t total_points);
+
+/**
+ * Measure the cost of delivering every point to several subscribers,
+ * first by pushing a copy into one blocking_queue per subscriber, then by
+ * publishing once into a broadcast_ring.
+ * @param subscribers Number of subscriber threads.
+ * @param total_points Number of points delivered to each subscriber.
+ * @param ring_capacity Number of slots in the broadcast ring.
+ */
+void execute_fanout(uint64_t subscribers, uint64_t total_points,
+                    size_t ring_capacity);
+
+/**
+ * Run the experiment as fine-grained tasks on a work stealing pool.
+ * Each producer task submits one task per point to its worker's deque,
+ * and idle workers steal them.
+ * @param threads_per_type Number of producer tasks. Twice as many
+ *                         workers are started.
+ * @param points_per_thread Number of points produced per producer task.
+ * @param sleep_ns Number of ns to sleep between each point.
+ */
+void execute_work_stealing(uint64_t threads_per_type,
+                           uint64_t points_per_thread, uint64_t sleep_ns);
+
+/**
+ * Run the experiment as one task per point on a thread pool.
+ * Producer threads post the tasks, which the pool's workers run.
+ * @param threads_per_type Number of producers. Twice as many workers are
+ *                         started.
+ * @param points_per_thread Number of points posted per producer.
+ * @param sleep_ns Number of ns to sleep between each point.
+ */
+void execute_thread_pool(uint64_t threads_per_type, uint64_t points_per_thread,
+                         uint64_t sleep_ns);
+
+/**
+ * Run the experiment as a pipeline of generate, classify and count stages,
+ * and report the counters of each stage.
+ * @param threads_per_type Number of producers, and of workers of the
+ *                         generate and classify stages each, at least one.
+ * @param points_per_thread Number of points per producer.
+ * @param sleep_ns Number of ns to sleep between each point.
+ */
+void execute_pipeline(uint64_t threads_per_type, uint64_t points_per_thread,
+                      uint64_t sleep_ns);
+
 /**
  * Run the sequential part of the experiment.
  * @param total_points Number of points to generate.
@@ -76,12 +150,63 @@ int main() {
   static constexpr uint64_t POINTS_PER_TYPE = 1 << 15;
   static const auto THREADS_PER_TYPE = thread::hardware_concurrency() / 2;
   static constexpr uint64_t SLEEP_NS = 50;
+  static constexpr size_t RING_CAPACITY = 1 << 10;
+  static constexpr uint64_t HANDOFF_POINTS = 1 << 20;
+  static constexpr uint64_t FANOUT_SUBSCRIBERS = 3;
   cout << "MONTE CARLO PI ESTIMATOR\n------------------------\n"
        << "\tAdditional " << SLEEP_NS << " ns added per point.\n";
 
-  execute_monitor(THREADS_PER_TYPE, 2 * POINTS_PER_TYPE, SLEEP_NS);
+  blocking_queue<pair<double, double>> monitor_points;
+  execute_monitor(monitor_points, "blocking_queue", THREADS_PER_TYPE,
+                  2 * POINTS_PER_TYPE, SLEEP_NS);
+  blocking_queue<pair<double, double>, spin_then_park_wait<>> spin_points;
+  execute_monitor(spin_points, "blocking_queue with spin_then_park_wait",
+                  THREADS_PER_TYPE, 2 * POINTS_PER_TYPE, SLEEP_NS);
+  // One lane per producer, with at least one lane.
+  sharded_queue<pair<double, double>> sharded_points(
+      std::max(THREADS_PER_TYPE, 1u));
+  execute_monitor(sharded_points, "sharded_queue", THREADS_PER_TYPE,
+                  2 * POINTS_PER_TYPE, SLEEP_NS);
+  futex_queue<pair<double, double>> futex_points;
+  execute_monitor(futex_points, "futex_queue", THREADS_PER_TYPE,
+                  2 * POINTS_PER_TYPE, SLEEP_NS);
+  mpmc_queue<pair<double, double>> ring_points(RING_CAPACITY);
+  execute_monitor(ring_points, "mpmc_queue", THREADS_PER_TYPE,
+                  2 * POINTS_PER_TYPE, SLEEP_NS);
+  lockfree_queue<pair<double, double>> list_points;
+  execute_monitor(list_points, "lockfree_queue", THREADS_PER_TYPE,
+                  2 * POINTS_PER_TYPE, SLEEP_NS);
+  execute_work_stealing(THREADS_PER_TYPE, 2 * POINTS_PER_TYPE, SLEEP_NS);
+  execute_thread_pool(THREADS_PER_TYPE, 2 * POINTS_PER_TYPE, SLEEP_NS);
+  execute_pipeline(THREADS_PER_TYPE, 2 * POINTS_PER_TYPE, SLEEP_NS);
   execute_sequential(2 * THREADS_PER_TYPE * POINTS_PER_TYPE, SLEEP_NS);
   execute_parallel(2 * THREADS_PER_TYPE, POINTS_PER_TYPE, SLEEP_NS);
+
+  blocking_queue<pair<double, double>> handoff_points;
+  execute_handoff(handoff_points, "blocking_queue", HANDOFF_POINTS);
+  blocking_queue<pair<double, double>, spin_then_park_wait<>> handoff_spin;
+  execute_handoff(handoff_spin, "blocking_queue with spin_then_park_wait",
+                  HANDOFF_POINTS);
+  blocking_queue<pair<double, double>, block_wait,
+                 segmented_queue<pair<double, double>>>
+      handoff_segmented;
+  execute_handoff(handoff_segmented, "blocking_queue with segmented_queue",
+                  HANDOFF_POINTS);
+  // Every allocation happens under the queue's lock, so the pool does not
+  // need its own synchronization.
+  std::pmr::unsynchronized_pool_resource handoff_pool;
+  pmr::blocking_queue<pair<double, double>> handoff_pmr(
+      pmr::blocking_queue<pair<double, double>>::UNBOUNDED, &handoff_pool);
+  execute_handoff(handoff_pmr, "pmr::blocking_queue with a pool resource",
+                  HANDOFF_POINTS);
+  futex_queue<pair<double, double>> handoff_futex;
+  execute_handoff(handoff_futex, "futex_queue", HANDOFF_POINTS);
+  mpmc_queue<pair<double, double>> handoff_ring(RING_CAPACITY);
+  execute_handoff(handoff_ring, "mpmc_queue", HANDOFF_POINTS);
+  lockfree_queue<pair<double, double>> handoff_list;
+  execute_handoff(handoff_list, "lockfree_queue", HANDOFF_POINTS);
+
+  execute_fanout(FANOUT_SUBSCRIBERS, HANDOFF_POINTS, RING_CAPACITY);
 }
 
 void report_time(nanoseconds dur) {
@@ -96,13 +221,14 @@ void report_accuracy(uint64_t in_circle, uint64_t total) {
   cout << "\tEstimate: " << est << "\n\tPercent error: " << 100 * error << '\n';
 }
 
-void execute_monitor(uint64_t threads_per_type, uint64_t points_per_thread,
+template <typename Queue>
+void execute_monitor(Queue& points, const char* name,
+                     uint64_t threads_per_type, uint64_t points_per_thread,
                      uint64_t sleep_ns) {
-  cout << "Monitor execution using blocking_queue.\n"
+  cout << "Monitor execution using " << name << ".\n"
        << "Running " << threads_per_type << " producers and "
        << threads_per_type << " consumers, each processing "
        << points_per_thread << " points..." << endl;
-  blocking_queue<pair<double, double>> points;
   atomic<uint64_t> in_circle(0);
 
   auto produce = [&] {
@@ -117,10 +243,9 @@ void execute_monitor(uint64_t threads_per_type, uint64_t points_per_thread,
   };
 
   auto consume = [&] {
-    for (uint64_t i = 0; i < points_per_thread; ++i) {
+    while (const auto pt = points.pop()) {
       sleep_for(nanoseconds(sleep_ns));
-      const auto pt = points.pop();
-      const auto dist_sq = pt.first * pt.first + pt.second * pt.second;
+      const auto dist_sq = pt->first * pt->first + pt->second * pt->second;
       if (dist_sq < 1.0) ++in_circle;
     }
   };
@@ -135,12 +260,207 @@ void execute_monitor(uint64_t threads_per_type, uint64_t points_per_thread,
     consumers.emplace_back(consume);
   }
   for (auto& producer : producers) producer.join();
+  points.close();
   for (auto& consumer : consumers) consumer.join();
 
   report_time(high_resolution_clock::now() - start);
   report_accuracy(in_circle.load(), threads_per_type * points_per_thread);
 }
 
+template <typename Queue>
+void execute_handoff(Queue& points, const char* name, uint64_t total_points) {
+  cout << "Handoff execution using " << name << ".\n"
+       << "Passing " << total_points
+       << " points from one producer to one consumer..." << endl;
+
+  auto produce = [&] {
+    for (uint64_t i = 0; i < total_points; ++i)
+      points.push(make_pair(0.0, 0.0));
+    points.close();
+  };
+
+  rusage before{}, after{};
+  getrusage(RUSAGE_SELF, &before);
+  const auto start = high_resolution_clock::now();
+  thread producer(produce);
+  uint64_t received = 0;
+  while (points.pop()) ++received;
+  producer.join();
+  const auto dur = duration_cast<nanoseconds>(high_resolution_clock::now() -
+                                             start);
+  getrusage(RUSAGE_SELF, &after);
+
+  report_time(dur);
+  const auto per_point = [received](long count) {
+    return static_cast<double>(count) / static_cast<double>(received);
+  };
+  cout << "\tPer point: " << dur.count() / static_cast<int64_t>(received)
+       << " ns\n"
+       << "\tContext switches per point: "
+       << per_point(after.ru_nvcsw - before.ru_nvcsw) << " voluntary, "
+       << per_point(after.ru_nivcsw - before.ru_nivcsw) << " involuntary\n";
+}
+
+void execute_fanout(uint64_t subscribers, uint64_t total_points,
+                    size_t ring_capacity) {
+  cout << "Fan-out execution using one blocking_queue per subscriber.\n"
+       << "Passing " << total_points << " points from one producer to "
+       << subscribers << " subscribers..." << endl;
+  vector<thread> threads;
+  threads.reserve(subscribers);
+
+  auto start = high_resolution_clock::now();
+  {
+    vector<blocking_queue<pair<double, double>>> queues(subscribers);
+    for (auto& queue : queues)
+      threads.emplace_back([&queue] {
+        while (queue.pop()) continue;
+      });
+    for (uint64_t i = 0; i < total_points; ++i)
+      for (auto& queue : queues) queue.push(make_pair(0.0, 0.0));
+    for (auto& queue : queues) queue.close();
+    for (auto& thread : threads) thread.join();
+  }
+  report_time(high_resolution_clock::now() - start);
+
+  cout << "Fan-out execution using broadcast_ring.\n"
+       << "Passing " << total_points << " points from one producer to "
+       << subscribers << " subscribers..." << endl;
+  threads.clear();
+
+  start = high_resolution_clock::now();
+  {
+    broadcast_ring<pair<double, double>> ring(ring_capacity, subscribers);
+    for (uint64_t idx = 0; idx < subscribers; ++idx)
+      threads.emplace_back([&ring, idx] {
+        while (ring.consume(idx, [](const pair<double, double>&) {}))
+          continue;
+      });
+    for (uint64_t i = 0; i < total_points; ++i)
+      ring.publish(make_pair(0.0, 0.0));
+    ring.close();
+    for (auto& thread : threads) thread.join();
+  }
+  report_time(high_resolution_clock::now() - start);
+}
+
+void execute_work_stealing(uint64_t threads_per_type,
+                           uint64_t points_per_thread, uint64_t sleep_ns) {
+  // At least one worker is needed to run any task.
+  const auto num_workers = std::max<uint64_t>(2 * threads_per_type, 1);
+  cout << "Work stealing execution using work_stealing_pool.\n"
+       << "Running " << threads_per_type << " producer tasks on "
+       << num_workers << " workers, each producing " << points_per_thread
+       << " point tasks..." << endl;
+  atomic<uint64_t> in_circle(0);
+
+  const auto start = high_resolution_clock::now();
+  {
+    work_stealing_pool pool(num_workers);
+    auto produce = [&] {
+      const auto seed = system_clock::now().time_since_epoch().count();
+      default_random_engine gen(seed);
+      uniform_real_distribution<double> distr(-1.0, 1.0);
+      for (uint64_t i = 0; i < points_per_thread; ++i) {
+        sleep_for(nanoseconds(sleep_ns));
+        const auto pt = make_pair(distr(gen), distr(gen));
+        pool.submit([&in_circle, pt, sleep_ns] {
+          sleep_for(nanoseconds(sleep_ns));
+          if (pt.first * pt.first + pt.second * pt.second < 1.0) ++in_circle;
+        });
+      }
+    };
+    for (uint64_t i = 0; i < threads_per_type; ++i) pool.submit(produce);
+  }
+
+  report_time(high_resolution_clock::now() - start);
+  report_accuracy(in_circle.load(), threads_per_type * points_per_thread);
+}
+
+void execute_thread_pool(uint64_t threads_per_type, uint64_t points_per_thread,
+                         uint64_t sleep_ns) {
+  // At least one worker is needed to run any task.
+  const auto num_workers = std::max<uint64_t>(2 * threads_per_type, 1);
+  cout << "Thread pool execution using thread_pool.\n"
+       << "Running " << threads_per_type << " producers posting to "
+       << num_workers << " workers, each producing " << points_per_thread
+       << " point tasks..." << endl;
+  atomic<uint64_t> in_circle(0);
+
+  const auto start = high_resolution_clock::now();
+  {
+    thread_pool pool(num_workers);
+    auto produce = [&] {
+      const auto seed = system_clock::now().time_since_epoch().count();
+      default_random_engine gen(seed);
+      uniform_real_distribution<double> distr(-1.0, 1.0);
+      for (uint64_t i = 0; i < points_per_thread; ++i) {
+        sleep_for(nanoseconds(sleep_ns));
+        const auto pt = make_pair(distr(gen), distr(gen));
+        pool.post([&in_circle, pt, sleep_ns] {
+          sleep_for(nanoseconds(sleep_ns));
+          if (pt.first * pt.first + pt.second * pt.second < 1.0) ++in_circle;
+        });
+      }
+    };
+    vector<thread> producers;
+    producers.reserve(threads_per_type);
+    for (uint64_t i = 0; i < threads_per_type; ++i)
+      producers.emplace_back(produce);
+    for (auto& producer : producers) producer.join();
+    pool.shutdown();
+  }
+
+  report_time(high_resolution_clock::now() - start);
+  report_accuracy(in_circle.load(), threads_per_type * points_per_thread);
+}
+
+void execute_pipeline(uint64_t threads_per_type, uint64_t points_per_thread,
+                      uint64_t sleep_ns) {
+  // Each stage needs at least one worker, but the points are counted per
+  // producer as in the other runs.
+  const auto workers = std::max<uint64_t>(threads_per_type, 1);
+  const auto total_points = threads_per_type * points_per_thread;
+  cout << "Pipeline execution using pipeline.\n"
+       << "Running " << workers << " generate and " << workers
+       << " classify workers over " << total_points << " points..." << endl;
+  atomic<uint64_t> generated(0), in_circle(0);
+
+  const auto start = high_resolution_clock::now();
+  pipeline stages;
+  stages
+      .source("generate", workers,
+              [&]() -> std::optional<pair<double, double>> {
+                thread_local default_random_engine gen(
+                    system_clock::now().time_since_epoch().count());
+                thread_local uniform_real_distribution<double> distr(-1.0,
+                                                                     1.0);
+                if (generated++ >= total_points) return std::nullopt;
+                sleep_for(nanoseconds(sleep_ns));
+                return make_pair(distr(gen), distr(gen));
+              })
+      .stage("classify", workers,
+             [sleep_ns](pair<double, double> pt) {
+               sleep_for(nanoseconds(sleep_ns));
+               return pt.first * pt.first + pt.second * pt.second < 1.0;
+             })
+      .sink("count", 1, [&in_circle](bool inside) {
+        if (inside) ++in_circle;
+      });
+  stages.wait();
+
+  report_time(high_resolution_clock::now() - start);
+  report_accuracy(in_circle.load(), total_points);
+  for (const auto& stage : stages.stats())
+    cout << "\tStage " << stage.name << ": " << stage.workers
+         << " workers, busy "
+         << duration_cast<milliseconds>(stage.busy).count()
+         << " ms, starved "
+         << duration_cast<milliseconds>(stage.starved).count()
+         << " ms, blocked "
+         << duration_cast<milliseconds>(stage.blocked).count() << " ms\n";
+}
+
 void execute_sequential(uint64_t total_points, uint64_t sleep_ns) {
   cout << "Sequential execution using iteration.\n"
        << "Processing " << total_points << " points iteratively..." << endl;
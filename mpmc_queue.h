@@ -0,0 +1,498 @@
+/*
+Lock-free, bounded, multi-producer, multi-consumer ring buffer.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#include "queue_util.h"
+
+/**
+ * Bounded ring buffer for any number of producer and consumer threads.
+ * Each slot carries a sequence number that tells producers and consumers
+ * whether it is free or full for the current lap, so threads only contend
+ * on a compare-and-swap of the head or tail index. Threads park on a
+ * condition variable only when the ring is empty or full. Closing sets a
+ * bit in the tail index, so no slot can be claimed afterwards and
+ * consumers drain exactly the slots claimed before it.
+ */
+template <typename T>
+class mpmc_queue {
+ private:
+  // Element storage stamped with the lap in which it is valid.
+  struct slot {
+    std::atomic<size_t> seq;
+    alignas(T) unsigned char bytes[sizeof(T)];
+  };
+
+  // Number of slots, a power of two, and the mask to index them.
+  const size_t m_capacity;
+  const size_t m_mask;
+  std::unique_ptr<slot[]> m_slots;
+
+  // Bit of the tail index set once the ring is closed.
+  static constexpr size_t CLOSED = ~(~size_t{0} >> 1);
+
+  // Next index to read and next index to write, with the closed bit.
+  alignas(CACHE_LINE) std::atomic<size_t> m_head{0};
+  alignas(CACHE_LINE) std::atomic<size_t> m_tail{0};
+
+  // Parking fallback, only touched when the ring is empty or full.
+  alignas(CACHE_LINE) std::atomic<size_t> m_waiting_consumers{0};
+  std::atomic<size_t> m_waiting_producers{0};
+  std::mutex m_mutex;
+  std::condition_variable m_not_empty;
+  std::condition_variable m_not_full;
+
+  /**
+   * Returns the element storage of a slot.
+   * @param cell The slot holding the element.
+   * @returns Pointer to the slot's element.
+   */
+  static T* element(slot& cell);
+
+  /**
+   * Determines whether the slot at the head holds a published element.
+   * @returns Whether a pop would likely succeed.
+   */
+  bool readable() const;
+
+  /**
+   * Determines whether the slot at the tail is free for this lap.
+   * @returns Whether a push would likely succeed.
+   */
+  bool writable() const;
+
+  /**
+   * Determines whether every slot claimed before close has been popped.
+   * Only meaningful once the ring is closed.
+   * @returns Whether a closed ring is drained.
+   */
+  bool drained() const;
+
+  /**
+   * Wakes one parked thread if any announced that it is about to park.
+   * @param waiting The number of parked threads on the other side.
+   * @param cv The condition variable the other side parks on.
+   */
+  void wake(const std::atomic<size_t>& waiting, std::condition_variable& cv);
+
+  /**
+   * Parks the calling thread until ready returns true or deadline passes.
+   * @param waiting The counter announcing the calling thread's side.
+   * @param cv The condition variable to park on.
+   * @param ready Returns whether the thread may stop waiting.
+   * @param deadline The latest time to wait.
+   * @returns The final value of ready.
+   */
+  template <typename Predicate, typename Clock, typename Duration>
+  bool park(std::atomic<size_t>& waiting, std::condition_variable& cv,
+            Predicate ready,
+            const std::chrono::time_point<Clock, Duration>& deadline);
+
+ public:
+  /**
+   * Initializes an empty ring holding at least capacity elements.
+   * @param capacity The minimum number of elements. Must be positive.
+   *                 Rounded up to a power of two, and to at least two,
+   *                 since a single slot's sequence cannot tell a full
+   *                 slot from a free one.
+   */
+  explicit mpmc_queue(size_t capacity);
+
+  /**
+   * Destroys any elements remaining in the ring.
+   */
+  ~mpmc_queue();
+
+  /**
+   * Prevent copying construction of mpmc queue.
+   */
+  mpmc_queue(const mpmc_queue<T>&) = delete;
+
+  /**
+   * Prevent assignment of mpmc queue.
+   */
+  mpmc_queue<T>& operator=(mpmc_queue<T>) = delete;
+
+  /**
+   * Determines whether the ring is empty
+   * at some non-deterministic time in the future.
+   * @returns The ring's emptiness status.
+   */
+  bool empty() const;
+
+  /**
+   * Approximates the number of elements in the ring. Counts elements
+   * that are being written or read at the time of the call.
+   * @returns The size of the ring.
+   */
+  size_t size() const;
+
+  /**
+   * Returns the maximum number of elements the ring holds.
+   * @returns The capacity.
+   */
+  size_t capacity() const;
+
+  /**
+   * Closes the ring and wakes every parked thread. Later pushes fail
+   * and pops return nothing once the remaining elements are drained.
+   */
+  void close();
+
+  /**
+   * Determines whether the ring has been closed.
+   * @returns The ring's closed status.
+   */
+  bool closed() const;
+
+  /**
+   * Pushes an element onto the ring, blocking while it is full.
+   * @param elem The item to enqueue.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(const T& elem);
+
+  /**
+   * Moves an element onto the ring, blocking while it is full.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(T&& elem);
+
+  /**
+   * Constructs an element from args and pushes it, blocking if needed.
+   * @param args The arguments forwarded to the constructor of T.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  template <typename... Args>
+  bool emplace(Args&&... args);
+
+  /**
+   * Pushes an element onto the ring only if it is not full or closed.
+   * @param elem The item to enqueue.
+   * @returns Whether the element was enqueued.
+   */
+  bool try_push(const T& elem);
+
+  /**
+   * Moves an element onto the ring only if it is not full or closed.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @returns Whether the element was enqueued.
+   */
+  bool try_push(T&& elem);
+
+  /**
+   * Pushes an element onto the ring, blocking for at most timeout.
+   * @param elem The item to enqueue.
+   * @param timeout The longest time to wait for space.
+   * @returns Whether the element was enqueued.
+   */
+  template <typename Rep, typename Period>
+  bool push_for(const T& elem,
+                const std::chrono::duration<Rep, Period>& timeout);
+
+  /**
+   * Moves an element onto the ring, blocking for at most timeout.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @param timeout The longest time to wait for space.
+   * @returns Whether the element was enqueued.
+   */
+  template <typename Rep, typename Period>
+  bool push_for(T&& elem, const std::chrono::duration<Rep, Period>& timeout);
+
+  /**
+   * Pushes an element onto the ring, blocking until at most deadline.
+   * @param elem The item to enqueue.
+   * @param deadline The latest time to wait for space.
+   * @returns Whether the element was enqueued.
+   */
+  template <typename Clock, typename Duration>
+  bool push_until(const T& elem,
+                  const std::chrono::time_point<Clock, Duration>& deadline);
+
+  /**
+   * Moves an element onto the ring, blocking until at most deadline.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @param deadline The latest time to wait for space.
+   * @returns Whether the element was enqueued.
+   */
+  template <typename Clock, typename Duration>
+  bool push_until(T&& elem,
+                  const std::chrono::time_point<Clock, Duration>& deadline);
+
+  /**
+   * Removes and returns an element, blocking while the ring is empty.
+   * @returns The next element, or nothing if closed and drained.
+   */
+  std::optional<T> pop();
+
+  /**
+   * Removes and returns an element only if one is available.
+   * @returns The next element, or nothing if the ring is empty.
+   */
+  std::optional<T> try_pop();
+
+  /**
+   * Removes and returns an element, blocking for at most timeout.
+   * @param timeout The longest time to wait for an element.
+   * @returns The next element, or nothing if the timeout expired
+   *          or the ring is closed and drained.
+   */
+  template <typename Rep, typename Period>
+  std::optional<T> pop_for(const std::chrono::duration<Rep, Period>& timeout);
+
+  /**
+   * Removes and returns an element, blocking until at most deadline.
+   * @param deadline The latest time to wait for an element.
+   * @returns The next element, or nothing if the deadline passed
+   *          or the ring is closed and drained.
+   */
+  template <typename Clock, typename Duration>
+  std::optional<T> pop_until(
+      const std::chrono::time_point<Clock, Duration>& deadline);
+};
+
+template <typename T>
+T* mpmc_queue<T>::element(slot& cell) {
+  return std::launder(reinterpret_cast<T*>(cell.bytes));
+}
+
+template <typename T>
+bool mpmc_queue<T>::readable() const {
+  const auto head = m_head.load(std::memory_order_relaxed);
+  return m_slots[head & m_mask].seq.load(std::memory_order_acquire) ==
+         head + 1;
+}
+
+template <typename T>
+bool mpmc_queue<T>::writable() const {
+  const auto tail = m_tail.load(std::memory_order_relaxed) & ~CLOSED;
+  return m_slots[tail & m_mask].seq.load(std::memory_order_acquire) == tail;
+}
+
+template <typename T>
+bool mpmc_queue<T>::drained() const {
+  const auto tail = m_tail.load(std::memory_order_acquire) & ~CLOSED;
+  return m_head.load(std::memory_order_acquire) >= tail;
+}
+
+template <typename T>
+void mpmc_queue<T>::wake(const std::atomic<size_t>& waiting,
+                         std::condition_variable& cv) {
+  // Pairs with the fence in park: either the parking thread sees our
+  // update, or we see its announcement and notify it.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiting.load(std::memory_order_relaxed) == 0) return;
+  { std::lock_guard lock(m_mutex); }
+  cv.notify_one();
+}
+
+template <typename T>
+template <typename Predicate, typename Clock, typename Duration>
+bool mpmc_queue<T>::park(
+    std::atomic<size_t>& waiting, std::condition_variable& cv,
+    Predicate ready,
+    const std::chrono::time_point<Clock, Duration>& deadline) {
+  std::unique_lock lock(m_mutex);
+  waiting.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const bool result = cv.wait_until(lock, deadline, ready);
+  waiting.fetch_sub(1, std::memory_order_relaxed);
+  return result;
+}
+
+template <typename T>
+mpmc_queue<T>::mpmc_queue(size_t capacity)
+    : m_capacity(std::max<size_t>(ring_capacity(capacity), 2)),
+      m_mask(m_capacity - 1),
+      m_slots(new slot[m_capacity]) {
+  for (size_t idx = 0; idx < m_capacity; ++idx)
+    m_slots[idx].seq.store(idx, std::memory_order_relaxed);
+}
+
+template <typename T>
+mpmc_queue<T>::~mpmc_queue() {
+  while (try_pop()) continue;
+}
+
+template <typename T>
+bool mpmc_queue<T>::empty() const {
+  return size() == 0;
+}
+
+template <typename T>
+size_t mpmc_queue<T>::size() const {
+  const auto head = m_head.load(std::memory_order_acquire);
+  const auto tail = m_tail.load(std::memory_order_acquire) & ~CLOSED;
+  return tail > head ? tail - head : 0;
+}
+
+template <typename T>
+size_t mpmc_queue<T>::capacity() const {
+  return m_capacity;
+}
+
+template <typename T>
+void mpmc_queue<T>::close() {
+  m_tail.fetch_or(CLOSED, std::memory_order_acq_rel);
+  { std::lock_guard lock(m_mutex); }
+  m_not_empty.notify_all();
+  m_not_full.notify_all();
+}
+
+template <typename T>
+bool mpmc_queue<T>::closed() const {
+  return (m_tail.load(std::memory_order_acquire) & CLOSED) != 0;
+}
+
+template <typename T>
+bool mpmc_queue<T>::push(const T& elem) {
+  return push(T(elem));
+}
+
+template <typename T>
+bool mpmc_queue<T>::push(T&& elem) {
+  return push_until(std::move(elem),
+                    std::chrono::steady_clock::time_point::max());
+}
+
+template <typename T>
+template <typename... Args>
+bool mpmc_queue<T>::emplace(Args&&... args) {
+  return push(T(std::forward<Args>(args)...));
+}
+
+template <typename T>
+bool mpmc_queue<T>::try_push(const T& elem) {
+  return try_push(T(elem));
+}
+
+template <typename T>
+bool mpmc_queue<T>::try_push(T&& elem) {
+  auto tail = m_tail.load(std::memory_order_relaxed);
+  while (true) {
+    // A failed compare-and-swap reloads the tail, including the bit.
+    if (tail & CLOSED) return false;
+    auto& cell = m_slots[tail & m_mask];
+    const auto seq = cell.seq.load(std::memory_order_acquire);
+    const auto diff =
+        static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(tail);
+    if (diff == 0) {
+      if (m_tail.compare_exchange_weak(tail, tail + 1,
+                                       std::memory_order_relaxed)) {
+        new (cell.bytes) T(std::move(elem));
+        cell.seq.store(tail + 1, std::memory_order_release);
+        wake(m_waiting_consumers, m_not_empty);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      tail = m_tail.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+template <typename T>
+template <typename Rep, typename Period>
+bool mpmc_queue<T>::push_for(
+    const T& elem, const std::chrono::duration<Rep, Period>& timeout) {
+  return push_until(T(elem), std::chrono::steady_clock::now() + timeout);
+}
+
+template <typename T>
+template <typename Rep, typename Period>
+bool mpmc_queue<T>::push_for(
+    T&& elem, const std::chrono::duration<Rep, Period>& timeout) {
+  return push_until(std::move(elem),
+                    std::chrono::steady_clock::now() + timeout);
+}
+
+template <typename T>
+template <typename Clock, typename Duration>
+bool mpmc_queue<T>::push_until(
+    const T& elem, const std::chrono::time_point<Clock, Duration>& deadline) {
+  return push_until(T(elem), deadline);
+}
+
+template <typename T>
+template <typename Clock, typename Duration>
+bool mpmc_queue<T>::push_until(
+    T&& elem, const std::chrono::time_point<Clock, Duration>& deadline) {
+  while (!try_push(std::move(elem))) {
+    if (closed()) return false;
+    if (!park(m_waiting_producers, m_not_full,
+              [this] { return closed() || writable(); }, deadline))
+      return try_push(std::move(elem));
+  }
+  return true;
+}
+
+template <typename T>
+std::optional<T> mpmc_queue<T>::pop() {
+  return pop_until(std::chrono::steady_clock::time_point::max());
+}
+
+template <typename T>
+std::optional<T> mpmc_queue<T>::try_pop() {
+  auto head = m_head.load(std::memory_order_relaxed);
+  while (true) {
+    auto& cell = m_slots[head & m_mask];
+    const auto seq = cell.seq.load(std::memory_order_acquire);
+    const auto diff = static_cast<std::ptrdiff_t>(seq) -
+                      static_cast<std::ptrdiff_t>(head + 1);
+    if (diff == 0) {
+      if (m_head.compare_exchange_weak(head, head + 1,
+                                       std::memory_order_relaxed)) {
+        auto* ptr = element(cell);
+        std::optional<T> elem(std::move(*ptr));
+        ptr->~T();
+        cell.seq.store(head + m_capacity, std::memory_order_release);
+        wake(m_waiting_producers, m_not_full);
+        return elem;
+      }
+    } else if (diff < 0) {
+      return std::nullopt;
+    } else {
+      head = m_head.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+template <typename T>
+template <typename Rep, typename Period>
+std::optional<T> mpmc_queue<T>::pop_for(
+    const std::chrono::duration<Rep, Period>& timeout) {
+  return pop_until(std::chrono::steady_clock::now() + timeout);
+}
+
+template <typename T>
+template <typename Clock, typename Duration>
+std::optional<T> mpmc_queue<T>::pop_until(
+    const std::chrono::time_point<Clock, Duration>& deadline) {
+  while (true) {
+    if (auto elem = try_pop()) return elem;
+    if (closed()) {
+      if (drained()) return std::nullopt;
+      // A producer claimed a slot before close and is still writing it.
+      std::this_thread::yield();
+      continue;
+    }
+    if (!park(m_waiting_consumers, m_not_empty,
+              [this] { return closed() || readable(); }, deadline))
+      return try_pop();
+  }
+}
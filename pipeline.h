@@ -0,0 +1,445 @@
+/*
+Multi-stage pipeline of worker threads connected by batched queues.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "blocking_queue.h"
+#include "spsc_queue.h"
+
+/**
+ * Chain of stages, each a function run by its own number of worker
+ * threads. A source stage generates elements, any number of transform
+ * stages map them, and a sink stage consumes them. Elements travel between
+ * stages in batches through bounded queues, so a slow stage applies
+ * backpressure to the ones before it. An edge between two single-worker
+ * stages is an spsc_queue, and any other edge is a blocking_queue.
+ *
+ * No worker starts until the sink is attached, which starts the whole
+ * chain at once. A chain left without a sink starts no threads, so it
+ * cannot block the destructor. When every worker of a source finishes
+ * or stop is called, each stage drains its input, closes its output and
+ * exits in turn. Each stage counts the elements it handles and the time
+ * its workers spend working, waiting for input and blocked on output,
+ * which shows the bottleneck stage to scale up. With more than one worker
+ * per stage, elements may be reordered. Stage functions are called
+ * concurrently by the stage's workers and must not throw.
+ */
+class pipeline {
+ public:
+  /**
+   * Snapshot of the counters of one stage.
+   */
+  struct stage_stats {
+    std::string name;
+    size_t workers;
+    // Elements handled by the stage.
+    uint64_t items;
+    // Time spent in the stage function, summed over the workers.
+    std::chrono::nanoseconds busy;
+    // Time spent waiting for input, summed over the workers.
+    std::chrono::nanoseconds starved;
+    // Time spent waiting for space downstream, summed over the workers.
+    std::chrono::nanoseconds blocked;
+  };
+
+ private:
+  using clock = std::chrono::steady_clock;
+
+  // Worker functions waiting for their chain to be started.
+  using task_list = std::vector<std::function<void()>>;
+
+  // Queue of batches between two stages.
+  template <typename T>
+  class edge {
+   private:
+    std::unique_ptr<spsc_queue<std::vector<T>>> m_single;
+    std::unique_ptr<blocking_queue<std::vector<T>>> m_shared;
+
+   public:
+    edge(bool single, size_t capacity);
+    void push(std::vector<T>&& batch);
+    std::optional<std::vector<T>> pop();
+    void close();
+  };
+
+  // Live counters of one stage.
+  struct stage_counters {
+    std::string name;
+    size_t workers;
+    std::atomic<size_t> running;
+    std::atomic<uint64_t> items{0};
+    std::atomic<int64_t> busy_ns{0};
+    std::atomic<int64_t> starved_ns{0};
+    std::atomic<int64_t> blocked_ns{0};
+
+    stage_counters(std::string label, size_t count)
+        : name(std::move(label)), workers(count), running(count) {}
+  };
+
+  // Maximum number of elements per batch.
+  const size_t m_batch_size;
+
+  // Maximum number of batches held by each edge.
+  const size_t m_edge_capacity;
+
+  // Counters of every stage in order. A deque keeps them in place.
+  std::deque<stage_counters> m_stages;
+
+  std::vector<std::thread> m_workers;
+
+  // Whether sources should stop generating.
+  std::atomic<bool> m_stopping{false};
+
+  /**
+   * Registers a stage and checks its worker count.
+   * @param name The name of the stage.
+   * @param workers The number of workers. Must be positive.
+   * @returns The counters of the stage.
+   */
+  stage_counters& add_stage(std::string name, size_t workers);
+
+  /**
+   * Adds elapsed time to a counter.
+   * @param counter The counter in nanoseconds.
+   * @param since The start of the interval.
+   * @returns The end of the interval.
+   */
+  static clock::time_point charge(std::atomic<int64_t>& counter,
+                                  clock::time_point since);
+
+  /**
+   * Starts a thread for each worker function of a complete chain.
+   * @param tasks The worker functions of every stage of the chain.
+   */
+  void launch(task_list& tasks);
+
+ public:
+  /**
+   * Output of a stage that has not been connected yet. The stage and the
+   * ones before it start once the chain ends in a sink.
+   * @tparam T The element type produced by the stage.
+   */
+  template <typename T>
+  class link {
+   private:
+    pipeline& m_owner;
+    size_t m_workers;
+    std::function<void(std::shared_ptr<edge<T>>, task_list&)> m_start;
+
+    // Worker functions of the stages before this one.
+    task_list m_pending;
+
+    /**
+     * Creates the edge to a next stage and adds the workers of this stage
+     * on it to those of the stages before it.
+     * @param next_workers The number of workers of the next stage.
+     * @param tasks Receives the worker functions of the chain so far.
+     * @returns The edge.
+     */
+    std::shared_ptr<edge<T>> connect(size_t next_workers, task_list& tasks);
+
+   public:
+    /**
+     * Initializes link. Created by pipeline only.
+     * @param owner The pipeline.
+     * @param workers The number of workers of the stage.
+     * @param start Adds the workers of the stage on its output edge.
+     * @param pending The worker functions of the stages before it.
+     */
+    link(pipeline& owner, size_t workers,
+         std::function<void(std::shared_ptr<edge<T>>, task_list&)> start,
+         task_list pending);
+
+    /**
+     * Attaches a transform stage.
+     * @param name The name reported in stats.
+     * @param workers The number of worker threads. Must be positive.
+     * @param fn Maps each element, called as fn(T&&).
+     * @returns The output of the new stage.
+     */
+    template <typename Function>
+    link<std::invoke_result_t<Function&, T&&>> stage(std::string name,
+                                                     size_t workers,
+                                                     Function fn);
+
+    /**
+     * Attaches the final stage and starts every worker of the chain.
+     * @param name The name reported in stats.
+     * @param workers The number of worker threads. Must be positive.
+     * @param fn Consumes each element, called as fn(T&&).
+     */
+    template <typename Function>
+    void sink(std::string name, size_t workers, Function fn);
+  };
+
+  /**
+   * Initializes pipeline with no stages.
+   * @param batch_size The maximum number of elements per batch, which
+   *                   amortizes queue synchronization. Must be positive.
+   * @param edge_capacity The maximum number of batches waiting between two
+   *                      stages. Must be positive.
+   */
+  explicit pipeline(size_t batch_size = 64, size_t edge_capacity = 16);
+
+  /**
+   * Stops the sources and waits for every stage to drain.
+   */
+  ~pipeline();
+
+  /**
+   * Prevent copying construction of pipeline.
+   */
+  pipeline(const pipeline&) = delete;
+
+  /**
+   * Prevent assignment of pipeline.
+   */
+  pipeline& operator=(pipeline) = delete;
+
+  /**
+   * Adds the first stage. Each worker calls fn until it returns nothing.
+   * @param name The name reported in stats.
+   * @param workers The number of worker threads. Must be positive.
+   * @param fn Generates the next element as a std::optional, or nothing
+   *           when the worker should finish.
+   * @returns The output of the source.
+   */
+  template <typename Function>
+  link<typename std::invoke_result_t<Function&>::value_type> source(
+      std::string name, size_t workers, Function fn);
+
+  /**
+   * Makes every source worker finish after its current element. The
+   * elements already generated still flow through the whole pipeline.
+   */
+  void stop();
+
+  /**
+   * Waits for every worker to finish. Must not be called by a worker.
+   */
+  void wait();
+
+  /**
+   * Reads the counters of every stage in order. May be called while the
+   * pipeline runs.
+   * @returns The counters of each stage.
+   */
+  std::vector<stage_stats> stats() const;
+};
+
+template <typename T>
+pipeline::edge<T>::edge(bool single, size_t capacity) {
+  if (single)
+    m_single = std::make_unique<spsc_queue<std::vector<T>>>(capacity);
+  else
+    m_shared = std::make_unique<blocking_queue<std::vector<T>>>(capacity);
+}
+
+template <typename T>
+void pipeline::edge<T>::push(std::vector<T>&& batch) {
+  if (m_single)
+    m_single->push(std::move(batch));
+  else
+    m_shared->push(std::move(batch));
+}
+
+template <typename T>
+std::optional<std::vector<T>> pipeline::edge<T>::pop() {
+  return m_single ? m_single->pop() : m_shared->pop();
+}
+
+template <typename T>
+void pipeline::edge<T>::close() {
+  if (m_single)
+    m_single->close();
+  else
+    m_shared->close();
+}
+
+inline pipeline::stage_counters& pipeline::add_stage(std::string name,
+                                                     size_t workers) {
+  if (workers == 0)
+    throw std::invalid_argument("pipeline stage needs a worker");
+  return m_stages.emplace_back(std::move(name), workers);
+}
+
+inline pipeline::clock::time_point pipeline::charge(
+    std::atomic<int64_t>& counter, clock::time_point since) {
+  const auto now = clock::now();
+  counter.fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(now - since)
+          .count(),
+      std::memory_order_relaxed);
+  return now;
+}
+
+inline void pipeline::launch(task_list& tasks) {
+  for (auto& task : tasks) m_workers.emplace_back(std::move(task));
+  tasks.clear();
+}
+
+template <typename T>
+pipeline::link<T>::link(
+    pipeline& owner, size_t workers,
+    std::function<void(std::shared_ptr<edge<T>>, task_list&)> start,
+    task_list pending)
+    : m_owner(owner),
+      m_workers(workers),
+      m_start(std::move(start)),
+      m_pending(std::move(pending)) {}
+
+template <typename T>
+std::shared_ptr<pipeline::edge<T>> pipeline::link<T>::connect(
+    size_t next_workers, task_list& tasks) {
+  if (!m_start) throw std::logic_error("pipeline stage already connected");
+  auto output = std::make_shared<edge<T>>(
+      m_workers == 1 && next_workers == 1, m_owner.m_edge_capacity);
+  auto start = std::move(m_start);
+  m_start = nullptr;
+  tasks = std::move(m_pending);
+  start(output, tasks);
+  return output;
+}
+
+template <typename T>
+template <typename Function>
+pipeline::link<std::invoke_result_t<Function&, T&&>>
+pipeline::link<T>::stage(std::string name, size_t workers, Function fn) {
+  using out_type = std::invoke_result_t<Function&, T&&>;
+  auto& counters = m_owner.add_stage(std::move(name), workers);
+  task_list tasks;
+  auto input = connect(workers, tasks);
+  auto shared_fn = std::make_shared<Function>(std::move(fn));
+  return link<out_type>(
+      m_owner, workers,
+      [&counters, input, shared_fn, workers](
+          std::shared_ptr<edge<out_type>> output, task_list& pending) {
+        auto work = [&counters, input, shared_fn, output] {
+          auto now = clock::now();
+          while (auto batch = input->pop()) {
+            now = charge(counters.starved_ns, now);
+            std::vector<out_type> results;
+            results.reserve(batch->size());
+            for (auto&& elem : *batch)
+              results.push_back((*shared_fn)(std::move(elem)));
+            counters.items.fetch_add(batch->size(),
+                                     std::memory_order_relaxed);
+            now = charge(counters.busy_ns, now);
+            output->push(std::move(results));
+            now = charge(counters.blocked_ns, now);
+          }
+          if (counters.running.fetch_sub(1) == 1) output->close();
+        };
+        for (size_t idx = 0; idx < workers; ++idx) pending.emplace_back(work);
+      },
+      std::move(tasks));
+}
+
+template <typename T>
+template <typename Function>
+void pipeline::link<T>::sink(std::string name, size_t workers, Function fn) {
+  auto& counters = m_owner.add_stage(std::move(name), workers);
+  task_list tasks;
+  auto input = connect(workers, tasks);
+  auto shared_fn = std::make_shared<Function>(std::move(fn));
+  auto work = [&counters, input, shared_fn] {
+    auto now = clock::now();
+    while (auto batch = input->pop()) {
+      now = charge(counters.starved_ns, now);
+      for (auto&& elem : *batch) (*shared_fn)(std::move(elem));
+      counters.items.fetch_add(batch->size(), std::memory_order_relaxed);
+      now = charge(counters.busy_ns, now);
+    }
+  };
+  for (size_t idx = 0; idx < workers; ++idx) tasks.emplace_back(work);
+  m_owner.launch(tasks);
+}
+
+inline pipeline::pipeline(size_t batch_size, size_t edge_capacity)
+    : m_batch_size(batch_size), m_edge_capacity(edge_capacity) {
+  if (batch_size == 0 || edge_capacity == 0)
+    throw std::invalid_argument("pipeline batches and edges must be sized");
+}
+
+inline pipeline::~pipeline() {
+  stop();
+  wait();
+}
+
+template <typename Function>
+pipeline::link<typename std::invoke_result_t<Function&>::value_type>
+pipeline::source(std::string name, size_t workers, Function fn) {
+  using out_type = typename std::invoke_result_t<Function&>::value_type;
+  auto& counters = add_stage(std::move(name), workers);
+  auto shared_fn = std::make_shared<Function>(std::move(fn));
+  return link<out_type>(
+      *this, workers,
+      [this, &counters, shared_fn, workers](
+          std::shared_ptr<edge<out_type>> output, task_list& pending) {
+        auto work = [this, &counters, shared_fn, output] {
+          std::vector<out_type> batch;
+          batch.reserve(m_batch_size);
+          auto now = clock::now();
+          while (!m_stopping.load(std::memory_order_relaxed)) {
+            auto elem = (*shared_fn)();
+            if (!elem) break;
+            batch.push_back(std::move(*elem));
+            if (batch.size() < m_batch_size) continue;
+            counters.items.fetch_add(batch.size(), std::memory_order_relaxed);
+            now = charge(counters.busy_ns, now);
+            output->push(std::move(batch));
+            now = charge(counters.blocked_ns, now);
+            batch = std::vector<out_type>();
+            batch.reserve(m_batch_size);
+          }
+          if (!batch.empty()) {
+            counters.items.fetch_add(batch.size(), std::memory_order_relaxed);
+            now = charge(counters.busy_ns, now);
+            output->push(std::move(batch));
+            charge(counters.blocked_ns, now);
+          }
+          if (counters.running.fetch_sub(1) == 1) output->close();
+        };
+        for (size_t idx = 0; idx < workers; ++idx) pending.emplace_back(work);
+      },
+      task_list());
+}
+
+inline void pipeline::stop() {
+  m_stopping.store(true, std::memory_order_relaxed);
+}
+
+inline void pipeline::wait() {
+  for (auto& worker : m_workers)
+    if (worker.joinable()) worker.join();
+}
+
+inline std::vector<pipeline::stage_stats> pipeline::stats() const {
+  std::vector<stage_stats> result;
+  result.reserve(m_stages.size());
+  for (const auto& each : m_stages)
+    result.push_back(
+        {each.name, each.workers,
+         each.items.load(std::memory_order_relaxed),
+         std::chrono::nanoseconds(each.busy_ns.load(std::memory_order_relaxed)),
+         std::chrono::nanoseconds(
+             each.starved_ns.load(std::memory_order_relaxed)),
+         std::chrono::nanoseconds(
+             each.blocked_ns.load(std::memory_order_relaxed))});
+  return result;
+}
@@ -0,0 +1,37 @@
+/*
+Thread safe, templated, blocking priority queue.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <functional>
+
+#include "blocking_queue.h"
+#include "dary_heap.h"
+
+/**
+ * Blocking queue that pops the greatest element according to Compare
+ * instead of the oldest, with the same push, pop, try_pop and close
+ * semantics as blocking_queue. Elements are kept in a 4-ary heap, so
+ * push and pop take logarithmic time under the lock.
+ * @tparam T The element type.
+ * @tparam Compare Strict weak ordering, where the greatest element is first.
+ * @tparam WaitPolicy How threads wait before parking, as in wait_policy.h.
+ */
+template <typename T, typename Compare = std::less<T>,
+          typename WaitPolicy = block_wait>
+using priority_blocking_queue =
+    blocking_queue<T, WaitPolicy, dary_heap<T, Compare>>;
+
+namespace pmr {
+
+/**
+ * Blocking priority queue whose heap allocates from a
+ * std::pmr::memory_resource.
+ */
+template <typename T, typename Compare = std::less<T>,
+          typename WaitPolicy = block_wait>
+using priority_blocking_queue =
+    ::blocking_queue<T, WaitPolicy, pmr::dary_heap<T, Compare>>;
+
+}  // namespace pmr
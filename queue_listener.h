@@ -0,0 +1,44 @@
+/*
+Interface for observing when a queue becomes ready to pop.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <cstddef>
+
+/**
+ * Receives readiness notifications from the queues it is subscribed to.
+ * A queue calls notify when it goes from empty to non-empty and when it
+ * is closed, and once at subscription if it is already either. Each queue
+ * passes the key it was subscribed with, so one listener can tell many
+ * queues apart. notify is called while the queue's lock is held, in the
+ * middle of a push or pop, so it must be short, is noexcept, and must not
+ * call back into the queue.
+ * A listener that only handles some keys overrides accepts, and queues
+ * refuse to subscribe it with any other key. A listener must be
+ * unsubscribed from every queue before it is destroyed.
+ */
+class queue_listener {
+ public:
+  /**
+   * Virtual destructor for deletion through the interface.
+   */
+  virtual ~queue_listener() = default;
+
+  /**
+   * Called when a subscribed queue may have become ready to pop.
+   * @param key The key the queue was subscribed with.
+   */
+  virtual void notify(size_t key) noexcept = 0;
+
+  /**
+   * Determines whether notify handles a key. Called by subscribe.
+   * @param key The key a queue is being subscribed with.
+   * @returns Whether the key is valid. Every key is unless overridden.
+   */
+  virtual bool accepts(size_t key) const;
+};
+
+inline bool queue_listener::accepts(size_t) const {
+  return true;
+}
@@ -0,0 +1,197 @@
+/*
+Listener that lets one thread wait on several queues at once.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+#include "queue_listener.h"
+#include "queue_util.h"
+
+/**
+ * Collects readiness notifications from many queues so that one thread can
+ * block until any of them has an element, like select on file
+ * descriptors. Subscribe each queue with a distinct key below keys(), then
+ * call select to wait for the key of a ready queue. Keys are returned in
+ * the order their queues became ready, and a key is held at most once, so
+ * notify never allocates.
+ *
+ * Notifications are edge-triggered: a queue reports only its transition
+ * from empty to non-empty, and closing. After select returns a key, drain
+ * that queue with try_pop until it is empty, or call notify with the key
+ * to have select return it again later.
+ */
+class queue_notifier : public queue_listener {
+ private:
+  // Whether each key is waiting to be selected.
+  std::vector<bool> m_pending;
+
+  // Circular list of the pending keys in the order they were notified.
+  std::vector<size_t> m_order;
+  size_t m_head = 0;
+  size_t m_count = 0;
+
+  // Synchronization primitives.
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+
+  // Threads blocked in select.
+  waiters m_selectors;
+
+  /**
+   * Removes and returns the oldest pending key.
+   * The caller must hold m_mutex and some key must be pending.
+   * @returns The key.
+   */
+  size_t take();
+
+ public:
+  /**
+   * Initializes notifier with no pending keys.
+   * @param num_keys The number of distinct keys. Must be positive.
+   */
+  explicit queue_notifier(size_t num_keys);
+
+  /**
+   * Prevent copying construction of queue notifier.
+   */
+  queue_notifier(const queue_notifier&) = delete;
+
+  /**
+   * Prevent assignment of queue notifier.
+   */
+  queue_notifier& operator=(queue_notifier) = delete;
+
+  /**
+   * Returns the number of distinct keys.
+   * @returns One more than the largest valid key.
+   */
+  size_t keys() const;
+
+  /**
+   * Marks key as ready and wakes a thread blocked in select, unless key is
+   * already pending.
+   * @param key The key of the ready queue. Must be less than keys(), which
+   *            subscribe checks through accepts.
+   */
+  void notify(size_t key) noexcept override;
+
+  /**
+   * Determines whether a key is below keys().
+   * @param key The key a queue is being subscribed with.
+   * @returns Whether notify accepts key.
+   */
+  bool accepts(size_t key) const override;
+
+  /**
+   * Blocks until some key is pending, then removes and returns it.
+   * @returns The key of a queue that became ready.
+   */
+  size_t select();
+
+  /**
+   * Removes and returns a pending key only if there is one.
+   * @returns The key of a queue that became ready, or nothing.
+   */
+  std::optional<size_t> try_select();
+
+  /**
+   * Removes and returns a pending key, blocking for at most timeout.
+   * @param timeout The longest time to wait.
+   * @returns The key of a queue that became ready, or nothing if the
+   *          timeout expired.
+   */
+  template <typename Rep, typename Period>
+  std::optional<size_t> select_for(
+      const std::chrono::duration<Rep, Period>& timeout);
+
+  /**
+   * Removes and returns a pending key, blocking until at most deadline.
+   * @param deadline The latest time to wait.
+   * @returns The key of a queue that became ready, or nothing if the
+   *          deadline passed.
+   */
+  template <typename Clock, typename Duration>
+  std::optional<size_t> select_until(
+      const std::chrono::time_point<Clock, Duration>& deadline);
+};
+
+inline size_t queue_notifier::take() {
+  const auto key = m_order[m_head];
+  m_head = (m_head + 1) % m_order.size();
+  --m_count;
+  m_pending[key] = false;
+  return key;
+}
+
+inline queue_notifier::queue_notifier(size_t num_keys)
+    : m_pending(num_keys, false), m_order(num_keys) {
+  if (num_keys == 0)
+    throw std::invalid_argument("queue_notifier needs a key");
+}
+
+inline size_t queue_notifier::keys() const {
+  return m_order.size();
+}
+
+inline void queue_notifier::notify(size_t key) noexcept {
+  assert(accepts(key));
+  std::unique_lock lock(m_mutex);
+  if (m_pending[key]) return;
+  m_pending[key] = true;
+  m_order[(m_head + m_count) % m_order.size()] = key;
+  ++m_count;
+  const auto wakeups = m_selectors.claim(1);
+  lock.unlock();
+  if (wakeups) m_ready.notify_one();
+}
+
+inline bool queue_notifier::accepts(size_t key) const {
+  return key < m_order.size();
+}
+
+inline size_t queue_notifier::select() {
+  std::unique_lock lock(m_mutex);
+  m_selectors.enter();
+  while (m_count == 0) {
+    m_ready.wait(lock);
+    m_selectors.wake_up();
+  }
+  m_selectors.leave();
+  return take();
+}
+
+inline std::optional<size_t> queue_notifier::try_select() {
+  std::lock_guard lock(m_mutex);
+  if (m_count == 0) return std::nullopt;
+  return take();
+}
+
+template <typename Rep, typename Period>
+std::optional<size_t> queue_notifier::select_for(
+    const std::chrono::duration<Rep, Period>& timeout) {
+  return select_until(std::chrono::steady_clock::now() + timeout);
+}
+
+template <typename Clock, typename Duration>
+std::optional<size_t> queue_notifier::select_until(
+    const std::chrono::time_point<Clock, Duration>& deadline) {
+  std::unique_lock lock(m_mutex);
+  m_selectors.enter();
+  while (m_count == 0) {
+    const auto status = m_ready.wait_until(lock, deadline);
+    m_selectors.wake_up();
+    if (status == std::cv_status::timeout) break;
+  }
+  m_selectors.leave();
+  if (m_count == 0) return std::nullopt;
+  return take();
+}
@@ -0,0 +1,79 @@
+/*
+Helpers shared by the ring buffer queues.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+
+/**
+ * Size of a cache line, used to keep independently written state apart.
+ */
+constexpr size_t CACHE_LINE = 64;
+
+/**
+ * Bookkeeping of the threads blocked on one condition, and how many of
+ * them have been signaled but not yet woken up. Lets signalers skip
+ * redundant wakeups. All members must be used under the same lock.
+ */
+struct waiters {
+  size_t blocked = 0;
+  size_t signaled = 0;
+
+  /**
+   * Registers the calling thread as blocked.
+   */
+  void enter() { ++blocked; }
+
+  /**
+   * Consumes one pending signal after the calling thread wakes up.
+   */
+  void wake_up() {
+    if (signaled > 0) --signaled;
+  }
+
+  /**
+   * Unregisters the calling thread once it stops waiting.
+   */
+  void leave() {
+    --blocked;
+    signaled = std::min(signaled, blocked);
+  }
+
+  /**
+   * Reserves up to count wakeups among threads not yet signaled.
+   * @param count The number of threads that could make progress.
+   * @returns The number of threads to wake.
+   */
+  size_t claim(size_t count) {
+    const auto wakeups = std::min(count, blocked - signaled);
+    signaled += wakeups;
+    return wakeups;
+  }
+};
+
+/**
+ * Rounds a positive capacity up to the nearest power of two.
+ * @param capacity The requested capacity.
+ * @returns The smallest power of two no less than capacity.
+ */
+inline size_t ring_capacity(size_t capacity) {
+  if (capacity == 0)
+    throw std::invalid_argument("ring capacity must be positive");
+  size_t rounded = 1;
+  while (rounded < capacity) rounded <<= 1;
+  return rounded;
+}
+
+/**
+ * Hints to the processor that the calling thread is spinning.
+ */
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile("yield");
+#endif
+}
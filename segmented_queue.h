@@ -0,0 +1,274 @@
+/*
+FIFO container built from reusable, fixed-size segments.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+#include "queue_util.h"
+
+/**
+ * FIFO container with the interface of std::queue that stores elements in
+ * cache-aligned segments of SegmentSize elements. Segments emptied by pop
+ * are kept on a free list and reused by push, so once the queue has grown
+ * to its working size, push and pop never call the allocator.
+ * Memory is retained at the peak size until the queue is destroyed.
+ * @tparam T The element type.
+ * @tparam SegmentSize The number of elements per segment.
+ * @tparam Allocator Allocates segments and constructs elements.
+ */
+template <typename T, size_t SegmentSize = 64,
+          typename Allocator = std::allocator<T>>
+class segmented_queue {
+ public:
+  using allocator_type = Allocator;
+
+ private:
+  static_assert(SegmentSize > 0, "segments must hold at least one element");
+
+  // Fixed-size block of element storage linked in FIFO order.
+  struct alignas(CACHE_LINE) segment {
+    segment* next = nullptr;
+    struct slot {
+      alignas(T) unsigned char bytes[sizeof(T)];
+    } slots[SegmentSize];
+  };
+
+  using element_traits = std::allocator_traits<Allocator>;
+  using segment_allocator =
+      typename element_traits::template rebind_alloc<segment>;
+  using segment_traits = std::allocator_traits<segment_allocator>;
+
+  // Source of segment memory and element construction.
+  Allocator m_alloc;
+
+  // Oldest and newest segments, and the positions of front and back.
+  segment* m_head = nullptr;
+  segment* m_tail = nullptr;
+  size_t m_head_idx = 0;
+  size_t m_tail_idx = 0;
+  size_t m_size = 0;
+
+  // Segments ready for reuse.
+  segment* m_free = nullptr;
+
+  /**
+   * Returns the element storage at an index of a segment.
+   * @param seg The segment holding the element.
+   * @param idx The index within the segment.
+   * @returns Pointer to the element.
+   */
+  static T* element(segment* seg, size_t idx);
+
+  /**
+   * Returns the first segment of the free list, allocating one onto the
+   * list if it is empty. The segment stays on the list until the caller
+   * unlinks it.
+   * @returns A segment without live elements.
+   */
+  segment* spare_segment();
+
+ public:
+  /**
+   * Default constructor initializes empty queue.
+   */
+  segmented_queue() = default;
+
+  /**
+   * Initializes empty queue that allocates segments from alloc.
+   * @param alloc The allocator to use.
+   */
+  explicit segmented_queue(const Allocator& alloc);
+
+  /**
+   * Destroys remaining elements and frees every segment.
+   */
+  ~segmented_queue();
+
+  /**
+   * Prevent copying construction of segmented queue.
+   */
+  segmented_queue(const segmented_queue&) = delete;
+
+  /**
+   * Prevent assignment of segmented queue.
+   */
+  segmented_queue& operator=(segmented_queue) = delete;
+
+  /**
+   * Returns a copy of the allocator.
+   * @returns The allocator.
+   */
+  Allocator get_allocator() const;
+
+  /**
+   * Determines whether the queue is empty.
+   * @returns The queue's emptiness status.
+   */
+  bool empty() const;
+
+  /**
+   * Determines the number of elements in the queue.
+   * @returns The size of the queue.
+   */
+  size_t size() const;
+
+  /**
+   * Accesses the oldest element. The queue must be non-empty.
+   * @returns Reference to the front element.
+   */
+  T& front();
+
+  /**
+   * Copies an element to the back of the queue.
+   * @param elem The item to enqueue.
+   */
+  void push(const T& elem);
+
+  /**
+   * Moves an element to the back of the queue.
+   * @param elem The item to enqueue.
+   */
+  void push(T&& elem);
+
+  /**
+   * Constructs an element in place at the back of the queue.
+   * @param args The arguments forwarded to the constructor of T.
+   */
+  template <typename... Args>
+  void emplace(Args&&... args);
+
+  /**
+   * Destroys the front element. The queue must be non-empty.
+   */
+  void pop();
+};
+
+namespace pmr {
+
+/**
+ * Segmented queue that allocates from a std::pmr::memory_resource.
+ */
+template <typename T, size_t SegmentSize = 64>
+using segmented_queue =
+    ::segmented_queue<T, SegmentSize, std::pmr::polymorphic_allocator<T>>;
+
+}  // namespace pmr
+
+template <typename T, size_t SegmentSize, typename Allocator>
+T* segmented_queue<T, SegmentSize, Allocator>::element(segment* seg,
+                                                       size_t idx) {
+  return std::launder(reinterpret_cast<T*>(seg->slots[idx].bytes));
+}
+
+template <typename T, size_t SegmentSize, typename Allocator>
+typename segmented_queue<T, SegmentSize, Allocator>::segment*
+segmented_queue<T, SegmentSize, Allocator>::spare_segment() {
+  if (!m_free) {
+    segment_allocator alloc(m_alloc);
+    m_free = segment_traits::allocate(alloc, 1);
+    segment_traits::construct(alloc, m_free);
+  }
+  return m_free;
+}
+
+template <typename T, size_t SegmentSize, typename Allocator>
+segmented_queue<T, SegmentSize, Allocator>::segmented_queue(
+    const Allocator& alloc)
+    : m_alloc(alloc) {}
+
+template <typename T, size_t SegmentSize, typename Allocator>
+segmented_queue<T, SegmentSize, Allocator>::~segmented_queue() {
+  while (!empty()) pop();
+  segment_allocator alloc(m_alloc);
+  for (auto* list : {m_head, m_free}) {
+    while (list) {
+      auto* next = list->next;
+      segment_traits::destroy(alloc, list);
+      segment_traits::deallocate(alloc, list, 1);
+      list = next;
+    }
+  }
+}
+
+template <typename T, size_t SegmentSize, typename Allocator>
+Allocator segmented_queue<T, SegmentSize, Allocator>::get_allocator() const {
+  return m_alloc;
+}
+
+template <typename T, size_t SegmentSize, typename Allocator>
+bool segmented_queue<T, SegmentSize, Allocator>::empty() const {
+  return m_size == 0;
+}
+
+template <typename T, size_t SegmentSize, typename Allocator>
+size_t segmented_queue<T, SegmentSize, Allocator>::size() const {
+  return m_size;
+}
+
+template <typename T, size_t SegmentSize, typename Allocator>
+T& segmented_queue<T, SegmentSize, Allocator>::front() {
+  return *element(m_head, m_head_idx);
+}
+
+template <typename T, size_t SegmentSize, typename Allocator>
+void segmented_queue<T, SegmentSize, Allocator>::push(const T& elem) {
+  emplace(elem);
+}
+
+template <typename T, size_t SegmentSize, typename Allocator>
+void segmented_queue<T, SegmentSize, Allocator>::push(T&& elem) {
+  emplace(std::move(elem));
+}
+
+template <typename T, size_t SegmentSize, typename Allocator>
+template <typename... Args>
+void segmented_queue<T, SegmentSize, Allocator>::emplace(Args&&... args) {
+  // Constructing through the allocator passes it on to allocator-aware
+  // elements, as standard containers do.
+  if (m_tail && m_tail_idx < SegmentSize) {
+    element_traits::construct(
+        m_alloc, reinterpret_cast<T*>(m_tail->slots[m_tail_idx].bytes),
+        std::forward<Args>(args)...);
+  } else {
+    // Construct before linking the segment, so that a throwing
+    // constructor leaves it on the free list and the queue unchanged.
+    auto* seg = spare_segment();
+    element_traits::construct(m_alloc,
+                              reinterpret_cast<T*>(seg->slots[0].bytes),
+                              std::forward<Args>(args)...);
+    m_free = seg->next;
+    seg->next = nullptr;
+    if (m_tail)
+      m_tail->next = seg;
+    else
+      m_head = seg;
+    m_tail = seg;
+    m_tail_idx = 0;
+  }
+  ++m_tail_idx;
+  ++m_size;
+}
+
+template <typename T, size_t SegmentSize, typename Allocator>
+void segmented_queue<T, SegmentSize, Allocator>::pop() {
+  element_traits::destroy(m_alloc, element(m_head, m_head_idx));
+  ++m_head_idx;
+  if (--m_size == 0) {
+    // Rewind into the current segment to keep reusing its cache lines.
+    m_head_idx = m_tail_idx = 0;
+    return;
+  }
+  if (m_head_idx == SegmentSize) {
+    auto* seg = m_head;
+    m_head = seg->next;
+    m_head_idx = 0;
+    seg->next = m_free;
+    m_free = seg;
+  }
+}
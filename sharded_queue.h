@@ -0,0 +1,364 @@
+/*
+Thread safe queue that spreads contention across several locked lanes.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "blocking_queue.h"
+#include "queue_util.h"
+
+/**
+ * Multi-producer, multi-consumer queue made of independent lanes, each a
+ * blocking_queue with its own mutex and condition variables. Each thread
+ * has a home lane for pushing and one for popping, assigned round robin
+ * among the threads using the same queue, so threads mostly lock
+ * different mutexes. A thread remembers its lanes only for the queue of
+ * this type it used last, so one that alternates between several queues
+ * is assigned a new lane whenever it switches. A consumer
+ * whose home lane is empty steals from the other lanes before parking on
+ * a shared condition variable. Elements pushed by one thread leave in
+ * FIFO order relative to each other only while they stay in one lane.
+ * @tparam T The element type.
+ * @tparam Storage The FIFO container of each lane, as in blocking_queue.
+ */
+template <typename T, typename Storage = std::queue<T>>
+class sharded_queue {
+ private:
+  // Lane on its own cache lines so lanes do not falsely share.
+  struct alignas(CACHE_LINE) lane {
+    blocking_queue<T, block_wait, Storage> queue;
+
+    explicit lane(size_t capacity) : queue(capacity) {}
+  };
+
+  // Home lane of a thread in the queue it used last.
+  struct home_lane {
+    uint64_t queue = 0;
+    size_t slot = 0;
+  };
+
+  std::vector<std::unique_ptr<lane>> m_lanes;
+
+  // Identifies this queue in home_lane, never reused by another queue.
+  const uint64_t m_id;
+
+  // Next home lanes to assign to pushing and popping threads.
+  std::atomic<size_t> m_next_producer{0};
+  std::atomic<size_t> m_next_consumer{0};
+
+  // Number of consumers parked or about to park on m_wake.
+  std::atomic<size_t> m_idle{0};
+
+  // Whether close has been called, written under m_mutex.
+  std::atomic<bool> m_closed{false};
+
+  // Synchronization primitives for parking consumers.
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+
+  /**
+   * Returns a new identifier for a queue.
+   * @returns An identifier distinct from every earlier one and from 0.
+   */
+  static uint64_t next_id();
+
+  /**
+   * Returns the calling thread's home lane in this queue, assigning the
+   * next one if cached belongs to another queue.
+   * @param cached The calling thread's last home lane.
+   * @param next The counter assigning home lanes in this queue.
+   * @returns The index of the lane, before reduction modulo the count.
+   */
+  size_t home_slot(home_lane& cached, std::atomic<size_t>& next) const;
+
+  /**
+   * Returns the push lane of the calling thread, assigned on first use.
+   * @returns The index of the lane, before reduction modulo the count.
+   */
+  size_t producer_slot();
+
+  /**
+   * Returns the pop lane of the calling thread, assigned on first use.
+   * @returns The index of the lane, before reduction modulo the count.
+   */
+  size_t consumer_slot();
+
+  /**
+   * Determines whether any lane looks non-empty, without locking.
+   * @returns Whether some lane holds an element.
+   */
+  bool has_elements() const;
+
+  /**
+   * Wakes a parked consumer, if any, after an element was pushed.
+   */
+  void wake_consumer();
+
+ public:
+  /**
+   * Initializes empty queue.
+   * @param num_lanes The number of lanes. Must be positive.
+   * @param lane_capacity The maximum number of elements per lane,
+   *                      or blocking_queue's UNBOUNDED.
+   */
+  explicit sharded_queue(
+      size_t num_lanes = std::thread::hardware_concurrency(),
+      size_t lane_capacity =
+          blocking_queue<T, block_wait, Storage>::UNBOUNDED);
+
+  /**
+   * Prevent copying construction of sharded queue.
+   */
+  sharded_queue(const sharded_queue&) = delete;
+
+  /**
+   * Prevent assignment of sharded queue.
+   */
+  sharded_queue& operator=(sharded_queue) = delete;
+
+  /**
+   * Returns the number of lanes.
+   * @returns The number of lanes.
+   */
+  size_t lanes() const;
+
+  /**
+   * Determines whether every lane is empty without taking any lock.
+   * The result is approximate while other threads push or pop.
+   * @returns The queue's emptiness status.
+   */
+  bool empty() const;
+
+  /**
+   * Determines the total number of elements without taking any lock.
+   * The result is approximate while other threads push or pop.
+   * @returns The size of the queue.
+   */
+  size_t size() const;
+
+  /**
+   * Closes every lane and wakes every blocked thread. Later pushes fail
+   * and pops return nothing once every lane is drained.
+   */
+  void close();
+
+  /**
+   * Determines whether the queue has been closed without taking a lock.
+   * @returns The queue's closed status.
+   */
+  bool closed() const;
+
+  /**
+   * Pushes an element onto the calling thread's lane. If that lane is
+   * full, tries the other lanes, then blocks on its own lane.
+   * @param elem The item to enqueue.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(const T& elem);
+
+  /**
+   * Moves an element onto the calling thread's lane. If that lane is
+   * full, tries the other lanes, then blocks on its own lane.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(T&& elem);
+
+  /**
+   * Constructs an element from args and pushes it, blocking if needed.
+   * @param args The arguments forwarded to the constructor of T.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  template <typename... Args>
+  bool emplace(Args&&... args);
+
+  /**
+   * Moves an element onto the first lane with space, starting from the
+   * calling thread's lane. Never blocks on a full queue.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @returns Whether the element was enqueued.
+   */
+  bool try_push(T&& elem);
+
+  /**
+   * Removes and returns an element, blocking if every lane is empty.
+   * @returns The next element, or nothing if closed and drained.
+   */
+  std::optional<T> pop();
+
+  /**
+   * Removes and returns an element from the calling thread's lane, or
+   * steals one from another lane, only if one is available.
+   * @returns The next element, or nothing if every lane is empty.
+   */
+  std::optional<T> try_pop();
+};
+
+template <typename T, typename Storage>
+uint64_t sharded_queue<T, Storage>::next_id() {
+  static std::atomic<uint64_t> last{0};
+  return last.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+template <typename T, typename Storage>
+size_t sharded_queue<T, Storage>::home_slot(home_lane& cached,
+                                            std::atomic<size_t>& next) const {
+  if (cached.queue != m_id) {
+    cached.queue = m_id;
+    cached.slot = next.fetch_add(1, std::memory_order_relaxed);
+  }
+  return cached.slot;
+}
+
+template <typename T, typename Storage>
+size_t sharded_queue<T, Storage>::producer_slot() {
+  static thread_local home_lane cached;
+  return home_slot(cached, m_next_producer);
+}
+
+template <typename T, typename Storage>
+size_t sharded_queue<T, Storage>::consumer_slot() {
+  static thread_local home_lane cached;
+  return home_slot(cached, m_next_consumer);
+}
+
+template <typename T, typename Storage>
+bool sharded_queue<T, Storage>::has_elements() const {
+  for (const auto& each : m_lanes)
+    if (!each->queue.empty()) return true;
+  return false;
+}
+
+template <typename T, typename Storage>
+void sharded_queue<T, Storage>::wake_consumer() {
+  // Pairs with the fence in pop: either this thread sees the consumer as
+  // idle, or the consumer sees the pushed element.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_idle.load(std::memory_order_relaxed) > 0) {
+    // A parking consumer holds m_mutex from its last check until it waits.
+    { std::lock_guard lock(m_mutex); }
+    m_wake.notify_one();
+  }
+}
+
+template <typename T, typename Storage>
+sharded_queue<T, Storage>::sharded_queue(size_t num_lanes,
+                                         size_t lane_capacity)
+    : m_id(next_id()) {
+  if (num_lanes == 0)
+    throw std::invalid_argument("sharded_queue needs a lane");
+  m_lanes.reserve(num_lanes);
+  for (size_t idx = 0; idx < num_lanes; ++idx)
+    m_lanes.push_back(std::make_unique<lane>(lane_capacity));
+}
+
+template <typename T, typename Storage>
+size_t sharded_queue<T, Storage>::lanes() const {
+  return m_lanes.size();
+}
+
+template <typename T, typename Storage>
+bool sharded_queue<T, Storage>::empty() const {
+  return !has_elements();
+}
+
+template <typename T, typename Storage>
+size_t sharded_queue<T, Storage>::size() const {
+  size_t total = 0;
+  for (const auto& each : m_lanes) total += each->queue.size();
+  return total;
+}
+
+template <typename T, typename Storage>
+void sharded_queue<T, Storage>::close() {
+  for (auto& each : m_lanes) each->queue.close();
+  {
+    std::lock_guard lock(m_mutex);
+    m_closed = true;
+  }
+  m_wake.notify_all();
+}
+
+template <typename T, typename Storage>
+bool sharded_queue<T, Storage>::closed() const {
+  return m_closed.load(std::memory_order_relaxed);
+}
+
+template <typename T, typename Storage>
+bool sharded_queue<T, Storage>::push(const T& elem) {
+  return push(T(elem));
+}
+
+template <typename T, typename Storage>
+bool sharded_queue<T, Storage>::push(T&& elem) {
+  if (try_push(std::move(elem))) return true;
+  // Every lane is full or closed, so wait for room in our own lane.
+  if (!m_lanes[producer_slot() % m_lanes.size()]->queue.push(
+          std::move(elem)))
+    return false;
+  wake_consumer();
+  return true;
+}
+
+template <typename T, typename Storage>
+template <typename... Args>
+bool sharded_queue<T, Storage>::emplace(Args&&... args) {
+  return push(T(std::forward<Args>(args)...));
+}
+
+template <typename T, typename Storage>
+bool sharded_queue<T, Storage>::try_push(T&& elem) {
+  const auto count = m_lanes.size();
+  const auto home = producer_slot() % count;
+  for (size_t offset = 0; offset < count; ++offset) {
+    if (m_lanes[(home + offset) % count]->queue.try_push(std::move(elem))) {
+      wake_consumer();
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename T, typename Storage>
+std::optional<T> sharded_queue<T, Storage>::pop() {
+  while (true) {
+    if (auto elem = try_pop()) return elem;
+    std::unique_lock lock(m_mutex);
+    m_idle.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!has_elements()) {
+      // Elements pushed before close are visible once m_closed is.
+      if (m_closed.load(std::memory_order_relaxed)) {
+        m_idle.fetch_sub(1, std::memory_order_relaxed);
+        return std::nullopt;
+      }
+      m_wake.wait(lock);
+    }
+    m_idle.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+template <typename T, typename Storage>
+std::optional<T> sharded_queue<T, Storage>::try_pop() {
+  const auto count = m_lanes.size();
+  const auto home = consumer_slot() % count;
+  for (size_t offset = 0; offset < count; ++offset) {
+    // Skip empty lanes without touching their mutexes.
+    auto& victim = m_lanes[(home + offset) % count]->queue;
+    if (victim.empty()) continue;
+    if (auto elem = victim.try_pop()) return elem;
+  }
+  return std::nullopt;
+}
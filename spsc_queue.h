@@ -0,0 +1,335 @@
+/*
+Lock-free, single-producer, single-consumer ring buffer.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <thread>
+#include <utility>
+
+#include "queue_util.h"
+
+/**
+ * Bounded ring buffer for exactly one producer thread and one consumer thread.
+ * Hands off elements with acquire/release atomics and only falls back to
+ * blocking on a condition variable when the ring is actually empty or full.
+ */
+template <typename T>
+class spsc_queue {
+ private:
+  // Uninitialized storage for one element.
+  struct slot {
+    alignas(T) unsigned char bytes[sizeof(T)];
+  };
+
+  // Number of slots, a power of two, and the mask to index them.
+  const size_t m_capacity;
+  const size_t m_mask;
+  std::unique_ptr<slot[]> m_slots;
+
+  // Consumer state: next index to read and last seen producer index.
+  alignas(CACHE_LINE) std::atomic<size_t> m_head{0};
+  size_t m_tail_cache = 0;
+
+  // Producer state: next index to write, last seen consumer index and
+  // whether a push that passed the closed check is still publishing.
+  alignas(CACHE_LINE) std::atomic<size_t> m_tail{0};
+  size_t m_head_cache = 0;
+  std::atomic<bool> m_pushing{false};
+
+  // Blocking fallback, only touched when the ring is empty or full.
+  alignas(CACHE_LINE) std::atomic<bool> m_consumer_waiting{false};
+  std::atomic<bool> m_producer_waiting{false};
+  std::atomic<bool> m_closed{false};
+  std::mutex m_mutex;
+  std::condition_variable m_not_empty;
+  std::condition_variable m_not_full;
+
+  /**
+   * Returns the element storage at a ring index.
+   * @param idx The unmasked ring index.
+   * @returns Pointer to the slot's element.
+   */
+  T* element(size_t idx);
+
+  /**
+   * Wakes the other side if it announced that it is about to block.
+   * @param waiting The other side's waiting flag.
+   * @param cv The condition variable the other side blocks on.
+   */
+  void wake(const std::atomic<bool>& waiting, std::condition_variable& cv);
+
+  /**
+   * Waits until a push that started before close has published its
+   * element, so that a pop seeing the ring closed also sees every
+   * element whose push succeeded.
+   */
+  void await_producer() const;
+
+ public:
+  /**
+   * Initializes an empty ring holding at least capacity elements.
+   * @param capacity The minimum number of elements. Must be positive.
+   *                 Rounded up to a power of two.
+   */
+  explicit spsc_queue(size_t capacity);
+
+  /**
+   * Destroys any elements remaining in the ring.
+   */
+  ~spsc_queue();
+
+  /**
+   * Prevent copying construction of spsc queue.
+   */
+  spsc_queue(const spsc_queue<T>&) = delete;
+
+  /**
+   * Prevent assignment of spsc queue.
+   */
+  spsc_queue<T>& operator=(spsc_queue<T>) = delete;
+
+  /**
+   * Determines whether the ring is empty. Exact only when called
+   * from the producer or consumer thread.
+   * @returns The ring's emptiness status.
+   */
+  bool empty() const;
+
+  /**
+   * Determines the number of elements in the ring. Exact only when
+   * called from the producer or consumer thread.
+   * @returns The size of the ring.
+   */
+  size_t size() const;
+
+  /**
+   * Returns the maximum number of elements the ring holds.
+   * @returns The capacity.
+   */
+  size_t capacity() const;
+
+  /**
+   * Closes the ring and wakes both threads. Later pushes fail and pops
+   * return nothing once the remaining elements are drained.
+   */
+  void close();
+
+  /**
+   * Determines whether the ring has been closed.
+   * @returns The ring's closed status.
+   */
+  bool closed() const;
+
+  /**
+   * Pushes an element onto the ring, blocking while it is full.
+   * Producer thread only.
+   * @param elem The item to enqueue.
+   * @returns Whether the element was enqueued, false if closed.
+   */
+  bool push(const T& elem);
+
+  /**
+   * Moves an element onto the ring, blocking while it is full.
+   * Producer thread only.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @returns Whether the element was enqueued, false if closed.
+   * @throws Whatever the move constructor of T throws, leaving the
+   *         ring unchanged.
+   */
+  bool push(T&& elem);
+
+  /**
+   * Pushes an element onto the ring only if it is not full or closed.
+   * Producer thread only.
+   * @param elem The item to enqueue.
+   * @returns Whether the element was enqueued.
+   */
+  bool try_push(const T& elem);
+
+  /**
+   * Moves an element onto the ring only if it is not full or closed.
+   * Producer thread only.
+   * @param elem The item to enqueue. Left untouched on failure.
+   * @returns Whether the element was enqueued.
+   * @throws Whatever the move constructor of T throws, leaving the
+   *         ring unchanged.
+   */
+  bool try_push(T&& elem);
+
+  /**
+   * Removes and returns an element, blocking while the ring is empty.
+   * Consumer thread only.
+   * @returns The next element, or nothing if closed and drained.
+   */
+  std::optional<T> pop();
+
+  /**
+   * Removes and returns an element only if one is available.
+   * Consumer thread only.
+   * @returns The next element, or nothing if the ring is empty.
+   */
+  std::optional<T> try_pop();
+};
+
+template <typename T>
+T* spsc_queue<T>::element(size_t idx) {
+  return std::launder(reinterpret_cast<T*>(m_slots[idx & m_mask].bytes));
+}
+
+template <typename T>
+void spsc_queue<T>::wake(const std::atomic<bool>& waiting,
+                         std::condition_variable& cv) {
+  // Pairs with the fence in the waiting thread: either it sees our update,
+  // or we see its flag and notify it.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!waiting.load(std::memory_order_relaxed)) return;
+  { std::lock_guard lock(m_mutex); }
+  cv.notify_one();
+}
+
+template <typename T>
+void spsc_queue<T>::await_producer() const {
+  // Pairs with the fence in try_push: either the producer sees the ring
+  // closed and fails, or we see its flag and wait for it to publish.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  while (m_pushing.load(std::memory_order_acquire)) std::this_thread::yield();
+}
+
+template <typename T>
+spsc_queue<T>::spsc_queue(size_t capacity)
+    : m_capacity(ring_capacity(capacity)),
+      m_mask(m_capacity - 1),
+      m_slots(new slot[m_capacity]) {}
+
+template <typename T>
+spsc_queue<T>::~spsc_queue() {
+  const auto tail = m_tail.load(std::memory_order_relaxed);
+  for (auto idx = m_head.load(std::memory_order_relaxed); idx != tail; ++idx)
+    element(idx)->~T();
+}
+
+template <typename T>
+bool spsc_queue<T>::empty() const {
+  return size() == 0;
+}
+
+template <typename T>
+size_t spsc_queue<T>::size() const {
+  const auto head = m_head.load(std::memory_order_acquire);
+  return m_tail.load(std::memory_order_acquire) - head;
+}
+
+template <typename T>
+size_t spsc_queue<T>::capacity() const {
+  return m_capacity;
+}
+
+template <typename T>
+void spsc_queue<T>::close() {
+  m_closed.store(true, std::memory_order_seq_cst);
+  { std::lock_guard lock(m_mutex); }
+  m_not_empty.notify_all();
+  m_not_full.notify_all();
+}
+
+template <typename T>
+bool spsc_queue<T>::closed() const {
+  return m_closed.load(std::memory_order_acquire);
+}
+
+template <typename T>
+bool spsc_queue<T>::push(const T& elem) {
+  return push(T(elem));
+}
+
+template <typename T>
+bool spsc_queue<T>::push(T&& elem) {
+  while (!try_push(std::move(elem))) {
+    std::unique_lock lock(m_mutex);
+    m_producer_waiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    m_not_full.wait(lock, [this] {
+      return closed() || m_tail.load(std::memory_order_relaxed) -
+                                 m_head.load(std::memory_order_acquire) <
+                             m_capacity;
+    });
+    m_producer_waiting.store(false, std::memory_order_relaxed);
+    if (closed()) return false;
+  }
+  return true;
+}
+
+template <typename T>
+bool spsc_queue<T>::try_push(const T& elem) {
+  return try_push(T(elem));
+}
+
+template <typename T>
+bool spsc_queue<T>::try_push(T&& elem) {
+  m_pushing.store(true, std::memory_order_relaxed);
+  // Pairs with the fence in await_producer: either a consumer that sees
+  // the ring closed waits for this push, or this push sees it closed.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const auto tail = m_tail.load(std::memory_order_relaxed);
+  if (tail - m_head_cache == m_capacity)
+    m_head_cache = m_head.load(std::memory_order_acquire);
+  if (m_closed.load(std::memory_order_relaxed) ||
+      tail - m_head_cache == m_capacity) {
+    m_pushing.store(false, std::memory_order_relaxed);
+    return false;
+  }
+  try {
+    new (m_slots[tail & m_mask].bytes) T(std::move(elem));
+  } catch (...) {
+    // A consumer that saw the ring closed must not wait for this push.
+    m_pushing.store(false, std::memory_order_release);
+    throw;
+  }
+  m_tail.store(tail + 1, std::memory_order_release);
+  m_pushing.store(false, std::memory_order_release);
+  wake(m_consumer_waiting, m_not_empty);
+  return true;
+}
+
+template <typename T>
+std::optional<T> spsc_queue<T>::pop() {
+  while (true) {
+    if (auto elem = try_pop()) return elem;
+    std::unique_lock lock(m_mutex);
+    m_consumer_waiting.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    m_not_empty.wait(lock, [this] {
+      return closed() || m_tail.load(std::memory_order_acquire) !=
+                             m_head.load(std::memory_order_relaxed);
+    });
+    m_consumer_waiting.store(false, std::memory_order_relaxed);
+    lock.unlock();
+    if (closed()) {
+      await_producer();
+      return try_pop();
+    }
+  }
+}
+
+template <typename T>
+std::optional<T> spsc_queue<T>::try_pop() {
+  const auto head = m_head.load(std::memory_order_relaxed);
+  if (head == m_tail_cache) {
+    m_tail_cache = m_tail.load(std::memory_order_acquire);
+    if (head == m_tail_cache) return std::nullopt;
+  }
+  auto* ptr = element(head);
+  std::optional<T> elem(std::move(*ptr));
+  ptr->~T();
+  m_head.store(head + 1, std::memory_order_release);
+  wake(m_producer_waiting, m_not_full);
+  return elem;
+}
@@ -0,0 +1,182 @@
+/*
+Move-only callable wrapper that stores small closures inline.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/**
+ * Type-erased, move-only callable taking no arguments and returning
+ * nothing, like a std::function<void()> that also accepts move-only
+ * closures such as std::packaged_task. Closures of up to INLINE_SIZE bytes
+ * that are nothrow movable are stored inside the task, so wrapping them
+ * never allocates. Larger closures are moved to the heap.
+ */
+class task {
+ public:
+  /**
+   * Largest closure stored without allocating.
+   */
+  static constexpr size_t INLINE_SIZE = 6 * sizeof(void*);
+
+ private:
+  // Operations on the stored closure, one table per closure type.
+  struct vtable {
+    void (*invoke)(void* storage);
+    void (*move)(void* dst, void* src) noexcept;
+    void (*destroy)(void* storage) noexcept;
+  };
+
+  template <typename F>
+  static constexpr bool stored_inline =
+      sizeof(F) <= INLINE_SIZE && alignof(F) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible_v<F>;
+
+  // Closure of type F held in the buffer itself.
+  template <typename F>
+  static void invoke_inline(void* storage);
+  template <typename F>
+  static void move_inline(void* dst, void* src) noexcept;
+  template <typename F>
+  static void destroy_inline(void* storage) noexcept;
+  template <typename F>
+  static const vtable inline_ops;
+
+  // Closure of type F on the heap, with its pointer held in the buffer.
+  template <typename F>
+  static void invoke_heap(void* storage);
+  static void move_heap(void* dst, void* src) noexcept;
+  template <typename F>
+  static void destroy_heap(void* storage) noexcept;
+  template <typename F>
+  static const vtable heap_ops;
+
+  alignas(std::max_align_t) unsigned char m_storage[INLINE_SIZE];
+  const vtable* m_ops = nullptr;
+
+ public:
+  /**
+   * Default constructor initializes empty task.
+   */
+  task() = default;
+
+  /**
+   * Wraps a callable.
+   * @param fn The callable, invoked with no arguments.
+   */
+  template <typename Function,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<Function>, task>>>
+  task(Function&& fn);
+
+  /**
+   * Takes the callable of other, leaving other empty.
+   * @param other The task to move from.
+   */
+  task(task&& other) noexcept;
+
+  /**
+   * Replaces the callable with that of other, leaving other empty.
+   * @param other The task to move from.
+   * @returns This task.
+   */
+  task& operator=(task&& other) noexcept;
+
+  /**
+   * Destroys the callable.
+   */
+  ~task();
+
+  /**
+   * Determines whether the task holds a callable.
+   * @returns Whether the task is non-empty.
+   */
+  explicit operator bool() const;
+
+  /**
+   * Invokes the callable. The task must be non-empty.
+   */
+  void operator()();
+};
+
+template <typename F>
+void task::invoke_inline(void* storage) {
+  (*std::launder(static_cast<F*>(storage)))();
+}
+
+template <typename F>
+void task::move_inline(void* dst, void* src) noexcept {
+  auto* from = std::launder(static_cast<F*>(src));
+  new (dst) F(std::move(*from));
+  from->~F();
+}
+
+template <typename F>
+void task::destroy_inline(void* storage) noexcept {
+  std::launder(static_cast<F*>(storage))->~F();
+}
+
+template <typename F>
+const task::vtable task::inline_ops = {&invoke_inline<F>, &move_inline<F>,
+                                       &destroy_inline<F>};
+
+template <typename F>
+void task::invoke_heap(void* storage) {
+  (*static_cast<F*>(*static_cast<void**>(storage)))();
+}
+
+inline void task::move_heap(void* dst, void* src) noexcept {
+  *static_cast<void**>(dst) = *static_cast<void**>(src);
+}
+
+template <typename F>
+void task::destroy_heap(void* storage) noexcept {
+  delete static_cast<F*>(*static_cast<void**>(storage));
+}
+
+template <typename F>
+const task::vtable task::heap_ops = {&invoke_heap<F>, &move_heap,
+                                     &destroy_heap<F>};
+
+template <typename Function, typename>
+task::task(Function&& fn) {
+  using F = std::decay_t<Function>;
+  if constexpr (stored_inline<F>) {
+    new (m_storage) F(std::forward<Function>(fn));
+    m_ops = &inline_ops<F>;
+  } else {
+    new (m_storage) void*(new F(std::forward<Function>(fn)));
+    m_ops = &heap_ops<F>;
+  }
+}
+
+inline task::task(task&& other) noexcept : m_ops(other.m_ops) {
+  if (m_ops) m_ops->move(m_storage, other.m_storage);
+  other.m_ops = nullptr;
+}
+
+inline task& task::operator=(task&& other) noexcept {
+  if (this != &other) {
+    if (m_ops) m_ops->destroy(m_storage);
+    m_ops = other.m_ops;
+    if (m_ops) m_ops->move(m_storage, other.m_storage);
+    other.m_ops = nullptr;
+  }
+  return *this;
+}
+
+inline task::~task() {
+  if (m_ops) m_ops->destroy(m_storage);
+}
+
+inline task::operator bool() const {
+  return m_ops != nullptr;
+}
+
+inline void task::operator()() {
+  m_ops->invoke(m_storage);
+}
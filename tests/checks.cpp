@@ -0,0 +1,871 @@
+/*
+Correctness checks for the queues. Built and run by make check.
+
+Copyright 2021. Andrew Wang.
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <memory_resource>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <poll.h>
+#endif
+
+#include "blocking_queue.h"
+#include "broadcast_ring.h"
+#include "coroutine_scheduler.h"
+#include "delay_queue.h"
+#if defined(__linux__)
+#include "eventfd_listener.h"
+#endif
+#include "lockfree_queue.h"
+#include "mpmc_queue.h"
+#include "pipeline.h"
+#include "priority_blocking_queue.h"
+#include "queue_notifier.h"
+#include "segmented_queue.h"
+#include "spsc_queue.h"
+#include "thread_pool.h"
+#include "work_stealing_deque.h"
+#include "work_stealing_pool.h"
+using std::atomic;
+using std::cout;
+using std::endl;
+using std::thread;
+using std::vector;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+/**
+ * Reports a failed check to std::cout and exits with an error.
+ * @param ok The checked condition.
+ * @param what The property that should hold.
+ */
+void check(bool ok, const char* what);
+
+/**
+ * Checks that every push that succeeds while another thread closes the
+ * queue is popped before the consumers see the queue drained.
+ * @param name The name of the queue type reported to std::cout.
+ * @param make Creates an empty queue for each round.
+ * @param producers Number of producer threads.
+ * @param consumers Number of consumer threads.
+ */
+template <typename Factory>
+void check_close_race(const char* name, Factory make, size_t producers,
+                      size_t consumers);
+
+/**
+ * Checks that a segmented_queue whose element constructor throws on a
+ * segment boundary keeps its elements in order.
+ */
+void check_segmented_throw();
+
+/**
+ * Fills a queue with lvalues pushed with timeouts, as blocking_queue and
+ * mpmc_queue both allow, and checks that they time out once it is full.
+ * @param name The name of the queue type.
+ * @param queue An empty, bounded queue.
+ */
+template <typename Queue>
+void check_timed_push(const char* name, Queue& queue);
+
+/**
+ * Pushes std::pmr::string elements into a pmr::blocking_queue in every
+ * way, with the default resource replaced by one that always fails, and
+ * checks that every allocation comes from the queue's resource.
+ */
+void check_pmr_push();
+
+/**
+ * Checks that a push into spsc_queue whose move constructor throws leaves
+ * the ring usable, so that pops after close still return.
+ */
+void check_spsc_throw();
+
+/**
+ * Checks that priority_blocking_queue pops in priority order after
+ * concurrent pushes, including many elements of equal priority, and that
+ * dary_heap honors its Compare and Arity.
+ */
+void check_priority_order();
+
+/**
+ * Checks that delay_queue releases elements in ready-time order and never
+ * early, that a new earliest element cuts short the leader's sleep, and
+ * that close releases pending elements before reporting the queue drained.
+ */
+void check_delay_release();
+
+/**
+ * Checks that thread_pool runs every task posted before shutdown, even
+ * when several threads shut it down at once, and rejects later tasks.
+ */
+void check_pool_shutdown();
+
+/**
+ * Races the owner of a work_stealing_deque against a thief for a single
+ * element, then grows a small deque while thieves steal from it, and
+ * checks that every element is taken exactly once.
+ */
+void check_deque_steal();
+
+/**
+ * Destroys a work_stealing_pool while its tasks are still spawning more
+ * tasks, and checks that every task runs.
+ */
+void check_stealing_shutdown();
+
+/**
+ * Checks that one thread selecting on a queue_notifier is woken by each
+ * of several queues, that keys come back in readiness order, and that
+ * invalid keys are rejected.
+ */
+void check_notifier_select();
+
+/**
+ * Runs a pipeline to completion, and destroys one whose chain never got a
+ * sink, which must not start or wait for its stages.
+ */
+void check_pipeline_chain();
+
+/**
+ * Checks that a lagging subscriber holds back the producers of a
+ * broadcast_ring, that close keeps what was already published, and that
+ * every subscriber receives every element from several producers.
+ */
+void check_broadcast_ring();
+
+#if defined(BLOCKING_QUEUE_COROUTINES)
+/**
+ * Pops from a queue within a coroutine until it is closed and drained.
+ * @param queue The queue to pop from.
+ * @param scheduler The executor to resume on.
+ * @param popped Counts the popped elements.
+ * @param finished Counts the coroutines that saw the queue drained.
+ */
+detached_task pop_all(blocking_queue<int>& queue,
+                      coroutine_scheduler& scheduler, atomic<int>& popped,
+                      atomic<int>& finished);
+
+/**
+ * Pushes elements onto a queue within a coroutine until one fails.
+ * @param queue The queue to push onto.
+ * @param scheduler The executor to resume on.
+ * @param count The number of elements to push.
+ * @param pushed Counts the pushed elements.
+ * @param finished Counts the coroutines that have returned.
+ */
+detached_task push_all(blocking_queue<int>& queue,
+                       coroutine_scheduler& scheduler, int count,
+                       atomic<int>& pushed, atomic<int>& finished);
+
+/**
+ * Drives async_pop and async_push through a coroutine_scheduler, alone
+ * and sharing a queue with blocking threads, and checks that close
+ * resumes every suspended coroutine.
+ */
+void check_coroutine_handoff();
+#endif
+
+#if defined(__linux__)
+/**
+ * Polls the descriptor of an eventfd_listener across many drain and
+ * refill cycles, with and without a concurrent producer, and checks that
+ * it becomes readable whenever the queue has elements to drain.
+ */
+void check_eventfd_refill();
+#endif
+
+int main() {
+  check_close_race(
+      "spsc_queue", [] { return std::make_unique<spsc_queue<int>>(4); }, 1,
+      1);
+  check_close_race(
+      "mpmc_queue", [] { return std::make_unique<mpmc_queue<int>>(4); }, 2,
+      2);
+  check_close_race(
+      "lockfree_queue", [] { return std::make_unique<lockfree_queue<int>>(); },
+      2, 2);
+  check_segmented_throw();
+  {
+    blocking_queue<int> blocking(1);
+    check_timed_push("blocking_queue", blocking);
+    mpmc_queue<int> ring(1);
+    check_timed_push("mpmc_queue", ring);
+  }
+  check_pmr_push();
+  check_spsc_throw();
+  check_priority_order();
+  check_delay_release();
+  check_pool_shutdown();
+  check_deque_steal();
+  check_stealing_shutdown();
+  check_notifier_select();
+  check_pipeline_chain();
+  check_broadcast_ring();
+#if defined(BLOCKING_QUEUE_COROUTINES)
+  check_coroutine_handoff();
+#endif
+#if defined(__linux__)
+  check_eventfd_refill();
+#endif
+  cout << "All checks passed." << endl;
+}
+
+void check(bool ok, const char* what) {
+  if (ok) return;
+  cout << "\tFAILED: " << what << endl;
+  std::exit(EXIT_FAILURE);
+}
+
+template <typename Factory>
+void check_close_race(const char* name, Factory make, size_t producers,
+                      size_t consumers) {
+  static constexpr int ROUNDS = 500;
+  static constexpr int PUSHES = 1000;
+  cout << "Checking close races of " << name << "..." << endl;
+  for (int round = 0; round < ROUNDS; ++round) {
+    auto queue = make();
+    atomic<int> pushed(0), popped(0);
+    vector<thread> threads;
+    for (size_t i = 0; i < producers; ++i)
+      threads.emplace_back([&] {
+        // Bounded so that unbounded queues do not grow until close.
+        for (int elem = 0; elem < PUSHES && queue->push(elem); ++elem)
+          ++pushed;
+      });
+    for (size_t i = 0; i < consumers; ++i)
+      threads.emplace_back([&] {
+        while (queue->pop()) ++popped;
+      });
+    // Vary how far the producers get before the queue is closed.
+    for (int i = 0; i < round % 16; ++i) std::this_thread::yield();
+    queue->close();
+    for (auto& worker : threads) worker.join();
+    check(pushed == popped, "every successful push is popped");
+  }
+}
+
+void check_segmented_throw() {
+  cout << "Checking throwing pushes into segmented_queue..." << endl;
+  // Throws when constructed from a negative value.
+  struct fragile {
+    int value;
+    explicit fragile(int val) : value(val) {
+      if (val < 0) throw std::runtime_error("negative");
+    }
+  };
+  segmented_queue<fragile, 2> queue;
+  queue.emplace(0);
+  queue.emplace(1);
+  bool thrown = false;
+  try {
+    queue.emplace(-1);
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  check(thrown && queue.size() == 2, "a throwing emplace adds nothing");
+  queue.pop();
+  queue.pop();
+  queue.emplace(2);
+  queue.emplace(3);
+  queue.emplace(4);
+  for (int expected = 2; expected <= 4; ++expected) {
+    check(queue.front().value == expected, "elements stay in order");
+    queue.pop();
+  }
+  check(queue.empty(), "the queue is drained");
+}
+
+template <typename Queue>
+void check_timed_push(const char* name, Queue& queue) {
+  cout << "Checking timed lvalue pushes into " << name << "..." << endl;
+  const int elem = 1;
+  for (size_t i = 0; i < queue.capacity(); ++i)
+    check(queue.push_for(elem, milliseconds(10)), "push_for takes an lvalue");
+  check(!queue.push_for(elem, milliseconds(10)) &&
+            !queue.push_until(elem, steady_clock::now() + milliseconds(10)),
+        "timed pushes into a full queue time out");
+  check(queue.pop() == elem, "a timed push enqueues its element");
+  check(queue.push_until(elem, steady_clock::now() + milliseconds(10)),
+        "push_until takes an lvalue");
+  check(queue.size() == queue.capacity(), "timed pushes fill the queue");
+}
+
+void check_pmr_push() {
+  cout << "Checking allocations of pmr::blocking_queue..." << endl;
+  // Counts the allocations it forwards to the global heap.
+  struct counting_resource : std::pmr::memory_resource {
+    size_t allocations = 0;
+    void* do_allocate(size_t bytes, size_t align) override {
+      ++allocations;
+      return std::pmr::new_delete_resource()->allocate(bytes, align);
+    }
+    void do_deallocate(void* ptr, size_t bytes, size_t align) override {
+      std::pmr::new_delete_resource()->deallocate(ptr, bytes, align);
+    }
+    bool do_is_equal(const memory_resource& other) const noexcept override {
+      return this == &other;
+    }
+  };
+  counting_resource arena;
+  // Any allocation from the default resource throws std::bad_alloc.
+  auto* const previous =
+      std::pmr::set_default_resource(std::pmr::null_memory_resource());
+  {
+    using queue_type = pmr::blocking_queue<std::pmr::string>;
+    queue_type queue(queue_type::UNBOUNDED, &arena);
+    // Long enough to allocate rather than fit in the string itself.
+    const std::pmr::string payload(64, 'x', &arena);
+    const auto deadline = steady_clock::now() + milliseconds(10);
+    bool pushed = false;
+    try {
+      pushed = queue.push(payload) && queue.emplace(64, 'y') &&
+               queue.try_push(payload) &&
+               queue.push_for(payload, milliseconds(10)) &&
+               queue.push_until(payload, deadline) &&
+               queue.push(std::pmr::string(payload, &arena));
+    } catch (const std::bad_alloc&) {
+    }
+    check(pushed, "no push allocates from the default resource");
+    check(arena.allocations > 6, "pushes allocate from the queue's resource");
+    for (int i = 0; i < 6; ++i) {
+      const auto elem = queue.try_pop();
+      check(elem && elem->size() == 64 &&
+                elem->get_allocator().resource() == &arena,
+            "popped elements keep the queue's resource");
+    }
+  }
+  std::pmr::set_default_resource(previous);
+}
+
+void check_spsc_throw() {
+  cout << "Checking throwing pushes into spsc_queue..." << endl;
+  // Throws when moved from an instance marked fragile.
+  struct fragile {
+    int value;
+    bool fragile_move;
+    fragile(int val, bool fragile_flag)
+        : value(val), fragile_move(fragile_flag) {}
+    fragile(fragile&& other) : value(other.value), fragile_move(false) {
+      if (other.fragile_move) throw std::runtime_error("fragile");
+    }
+  };
+  spsc_queue<fragile> queue(4);
+  check(queue.push(fragile(0, false)), "a plain push succeeds");
+  bool thrown = false;
+  try {
+    queue.try_push(fragile(1, true));
+  } catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  check(thrown && queue.size() == 1, "a throwing push adds nothing");
+  queue.close();
+  const auto elem = queue.pop();
+  check(elem && elem->value == 0, "the ring keeps its element");
+  check(!queue.pop(), "pop reports the closed ring drained");
+}
+
+void check_priority_order() {
+  static constexpr int PRODUCERS = 4;
+  static constexpr int PER_PRODUCER = 2000;
+  static constexpr int PRIORITIES = 16;
+  cout << "Checking pop order of priority_blocking_queue..." << endl;
+  // Priority and a unique id. Only the priority is compared, so ids of
+  // equal priority may leave in any order.
+  using item = std::pair<int, int>;
+  struct by_priority {
+    bool operator()(const item& lhs, const item& rhs) const {
+      return lhs.first < rhs.first;
+    }
+  };
+  priority_blocking_queue<item, by_priority> queue;
+  vector<thread> producers;
+  for (int idx = 0; idx < PRODUCERS; ++idx)
+    producers.emplace_back([&queue, idx] {
+      std::minstd_rand gen(static_cast<unsigned>(idx));
+      for (int i = 0; i < PER_PRODUCER; ++i)
+        queue.push(item(static_cast<int>(gen() % PRIORITIES),
+                        idx * PER_PRODUCER + i));
+    });
+  for (auto& producer : producers) producer.join();
+  queue.close();
+  vector<bool> seen(PRODUCERS * PER_PRODUCER, false);
+  int last = PRIORITIES;
+  while (const auto elem = queue.pop()) {
+    check(elem->first <= last, "priorities never increase");
+    check(!seen[static_cast<size_t>(elem->second)], "no element repeats");
+    seen[static_cast<size_t>(elem->second)] = true;
+    last = elem->first;
+  }
+  check(std::all_of(seen.begin(), seen.end(), [](bool hit) { return hit; }),
+        "every element is popped");
+
+  std::minstd_rand gen(7);
+  dary_heap<unsigned, std::greater<unsigned>, 3> heap;
+  vector<unsigned> values;
+  for (int i = 0; i < 1000; ++i) {
+    values.push_back(static_cast<unsigned>(gen() % 100));
+    heap.push(values.back());
+  }
+  std::sort(values.begin(), values.end());
+  for (const auto value : values) {
+    check(heap.front() == value, "a min-heap pops in ascending order");
+    heap.pop();
+  }
+  check(heap.empty(), "the heap is drained");
+}
+
+void check_delay_release() {
+  cout << "Checking release times of delay_queue..." << endl;
+  // Upper bound on scheduling lateness, generous for loaded machines.
+  static constexpr milliseconds SLACK(250);
+  delay_queue<int> queue;
+  const auto start = steady_clock::now();
+  const int delays[] = {40, 10, 30, 20, 30};
+  for (int idx = 0; idx < 5; ++idx)
+    queue.push(idx, start + milliseconds(delays[idx]));
+  check(!queue.try_pop(), "nothing is due before its ready time");
+  // Equal ready times leave in push order.
+  for (const int expected : {1, 3, 2, 4, 0}) {
+    const auto elem = queue.pop();
+    const auto ready_at = start + milliseconds(delays[expected]);
+    const auto now = steady_clock::now();
+    check(elem && *elem == expected, "elements leave by ready time");
+    check(now >= ready_at, "no element is released early");
+    check(now < ready_at + SLACK, "elements are released on time");
+  }
+
+  // The consumer sleeps until the far element, then the near one arrives.
+  queue.push(0, milliseconds(600));
+  std::optional<int> early;
+  auto popped_at = steady_clock::now();
+  thread consumer([&] {
+    early = queue.pop();
+    popped_at = steady_clock::now();
+  });
+  std::this_thread::sleep_for(milliseconds(20));
+  const auto near_at = steady_clock::now() + milliseconds(30);
+  queue.push(1, near_at);
+  consumer.join();
+  check(early && *early == 1, "a new earliest element is popped first");
+  check(popped_at >= near_at && popped_at < near_at + SLACK,
+        "a new earliest element wakes the sleeping leader");
+
+  // The far element is still pending when the queue is closed.
+  queue.close();
+  check(!queue.push(2, milliseconds(0)), "pushes fail once closed");
+  check(queue.size() == 1, "pending elements survive close");
+  check(!queue.pop_for(milliseconds(10)), "pending elements stay pending");
+  check(queue.pop() == 0, "pending elements are released after close");
+  check(!queue.pop(), "pop reports the closed queue drained");
+}
+
+void check_pool_shutdown() {
+  static constexpr int TASKS = 1000;
+  static constexpr int STOPPERS = 3;
+  cout << "Checking concurrent shutdown of thread_pool..." << endl;
+  atomic<int> done(0);
+  {
+    thread_pool pool(4);
+    for (int i = 0; i < TASKS; ++i) pool.post([&done] { ++done; });
+    auto answer = pool.submit([] { return 42; });
+    vector<thread> stoppers;
+    for (int i = 0; i < STOPPERS; ++i)
+      stoppers.emplace_back([&] {
+        pool.shutdown();
+        check(done == TASKS, "shutdown returns after every task ran");
+      });
+    for (auto& stopper : stoppers) stopper.join();
+    check(answer.get() == 42, "submitted tasks deliver their result");
+    check(!pool.post([&done] { ++done; }), "posts fail after shutdown");
+    auto late = pool.submit([] { return 0; });
+    bool broken = false;
+    try {
+      late.get();
+    } catch (const std::future_error& err) {
+      broken = err.code() == std::future_errc::broken_promise;
+    }
+    check(broken, "submits after shutdown break their promise");
+  }
+  check(done == TASKS, "no task runs after shutdown");
+}
+
+void check_deque_steal() {
+  static constexpr int ROUNDS = 20000;
+  static constexpr int THIEVES = 3;
+  static constexpr int PUSHES = 50000;
+  cout << "Checking steals from work_stealing_deque..." << endl;
+  {
+    // Each round, the owner pops the only element while a thief steals.
+    work_stealing_deque<int> deque(2);
+    atomic<int> published(0), popped_round(-1), owner_wins(0);
+    atomic<int> thief_wins(0), acknowledged(-1);
+    thread thief([&] {
+      for (int round = 0; round < ROUNDS; ++round) {
+        while (published.load() <= round) std::this_thread::yield();
+        while (true) {
+          if (const auto elem = deque.steal()) {
+            check(*elem == round, "a thief steals the round's element");
+            ++thief_wins;
+            break;
+          }
+          if (popped_round.load() == round) break;
+        }
+        acknowledged = round;
+      }
+    });
+    for (int round = 0; round < ROUNDS; ++round) {
+      deque.push(round);
+      published = round + 1;
+      for (int i = 0; i < round % 4; ++i) std::this_thread::yield();
+      if (const auto elem = deque.pop()) {
+        check(*elem == round, "the owner pops the round's element");
+        ++owner_wins;
+      }
+      popped_round = round;
+      while (acknowledged.load() < round) std::this_thread::yield();
+      check(owner_wins + thief_wins == round + 1,
+            "exactly one side takes the last element");
+    }
+    thief.join();
+    check(deque.empty(), "the deque is drained");
+  }
+
+  // The owner pushes far past the initial capacity, popping now and then,
+  // while the thieves take from the other end.
+  work_stealing_deque<int> deque(2);
+  std::unique_ptr<atomic<int>[]> taken(new atomic<int>[PUSHES]);
+  for (int i = 0; i < PUSHES; ++i) taken[i] = 0;
+  atomic<bool> finished(false);
+  vector<thread> thieves;
+  for (int i = 0; i < THIEVES; ++i)
+    thieves.emplace_back([&] {
+      while (!finished.load())
+        if (const auto elem = deque.steal()) ++taken[*elem];
+    });
+  for (int elem = 0; elem < PUSHES; ++elem) {
+    deque.push(elem);
+    if (elem % 7 == 0)
+      if (const auto popped = deque.pop()) ++taken[*popped];
+  }
+  while (const auto popped = deque.pop()) ++taken[*popped];
+  finished = true;
+  for (auto& each : thieves) each.join();
+  for (int i = 0; i < PUSHES; ++i)
+    check(taken[i] == 1, "every element is taken exactly once");
+}
+
+void check_stealing_shutdown() {
+  static constexpr int ROOTS = 20;
+  static constexpr int CHILDREN = 200;
+  cout << "Checking shutdown of work_stealing_pool..." << endl;
+  atomic<int> done(0);
+  {
+    work_stealing_pool pool(4);
+    for (int root = 0; root < ROOTS; ++root)
+      pool.submit([&pool, &done] {
+        // Still spawning once the destructor has begun.
+        std::this_thread::sleep_for(milliseconds(1));
+        for (int child = 0; child < CHILDREN; ++child)
+          pool.submit([&pool, &done] {
+            pool.submit([&done] { ++done; });
+            ++done;
+          });
+        ++done;
+      });
+  }
+  check(done == ROOTS * (1 + 2 * CHILDREN),
+        "the destructor runs every spawned task");
+}
+
+void check_notifier_select() {
+  static constexpr size_t QUEUES = 3;
+  static constexpr int ROUNDS = 300;
+  cout << "Checking queue_notifier over several queues..." << endl;
+  // Declared first so that it outlives the queues subscribed to it.
+  queue_notifier notifier(QUEUES);
+  vector<blocking_queue<int>> queues(QUEUES);
+  bool rejected = false;
+  try {
+    queues[0].subscribe(notifier, QUEUES);
+  } catch (const std::invalid_argument&) {
+    rejected = true;
+  }
+  check(rejected, "subscribe rejects keys beyond the notifier");
+  for (size_t key = 0; key < QUEUES; ++key)
+    queues[key].subscribe(notifier, key);
+
+  queues[2].push(0);
+  queues[0].push(0);
+  check(notifier.try_select() == 2u && notifier.try_select() == 0u &&
+            !notifier.try_select(),
+        "keys are selected in the order their queues became ready");
+  queues[2].try_pop();
+  queues[0].try_pop();
+
+  atomic<int> received(0);
+  vector<int> per_key(QUEUES, 0);
+  thread waiter([&] {
+    vector<bool> finished(QUEUES, false);
+    size_t open = QUEUES;
+    while (open > 0) {
+      const auto key = notifier.select();
+      while (queues[key].try_pop()) {
+        ++per_key[key];
+        ++received;
+      }
+      if (queues[key].closed() && queues[key].empty() && !finished[key]) {
+        finished[key] = true;
+        --open;
+      }
+    }
+  });
+  // Each push must wake the waiter, whichever queue it goes to.
+  for (int round = 0; round < ROUNDS; ++round) {
+    queues[static_cast<size_t>(round) % QUEUES].push(round);
+    while (received <= round) std::this_thread::yield();
+  }
+  for (auto& queue : queues) queue.close();
+  waiter.join();
+  for (size_t key = 0; key < QUEUES; ++key) {
+    check(per_key[key] == ROUNDS / static_cast<int>(QUEUES),
+          "the waiter drains every queue");
+    queues[key].unsubscribe(notifier);
+  }
+}
+
+void check_pipeline_chain() {
+  static constexpr int ELEMS = 10000;
+  cout << "Checking chains of pipeline..." << endl;
+  atomic<int> generated(0), sum(0);
+  {
+    pipeline stages(16, 4);
+    stages
+        .source("generate", 2,
+                [&]() -> std::optional<int> {
+                  const int elem = generated++;
+                  if (elem >= ELEMS) return std::nullopt;
+                  return elem % 3;
+                })
+        .stage("double", 2, [](int elem) { return 2 * elem; })
+        .sink("sum", 1, [&sum](int elem) { sum += elem; });
+    stages.wait();
+    const auto stats = stages.stats();
+    check(stats.size() == 3 && stats[0].items == ELEMS &&
+              stats[1].items == ELEMS && stats[2].items == ELEMS,
+          "every stage handles every element");
+  }
+  // The elements cycle through 0, 1 and 2, and are doubled.
+  check(sum == 2 * (ELEMS / 3 * 3 + (ELEMS % 3 == 2 ? 1 : 0)),
+        "the sink receives every element");
+
+  // A source that never finishes, with no sink behind it.
+  generated = 0;
+  {
+    pipeline stages(16, 4);
+    stages
+        .source("generate", 1,
+                [&]() -> std::optional<int> { return generated++; })
+        .stage("double", 1, [](int elem) { return 2 * elem; });
+  }
+  check(generated == 0, "a chain without a sink never starts");
+}
+
+void check_broadcast_ring() {
+  static constexpr int PRODUCERS = 3;
+  static constexpr size_t SUBSCRIBERS = 3;
+  static constexpr int ELEMS = 3000;
+  cout << "Checking delivery through broadcast_ring..." << endl;
+  {
+    broadcast_ring<int> ring(8, 2);
+    int published = 0;
+    while (ring.try_publish(int(published))) ++published;
+    check(published == 8 && ring.backlog(1) == ring.capacity(),
+          "try_publish fails once a subscriber is a full ring behind");
+    while (ring.try_consume(0, [](const int&) {})) {
+    }
+    check(!ring.try_publish(0), "the slowest subscriber gates producers");
+    auto pending = std::async(std::launch::async,
+                              [&ring, published] {
+                                return ring.publish(published);
+                              });
+    check(pending.wait_for(milliseconds(20)) == std::future_status::timeout,
+          "publish blocks while a subscriber is a full ring behind");
+    check(ring.receive(1) == 0, "the lagging subscriber reads in order");
+    check(pending.get(), "publish resumes once the subscriber catches up");
+    ring.close();
+    check(!ring.publish(0), "publishes fail once closed");
+    for (int elem = 1; elem <= published; ++elem)
+      check(ring.receive(1) == elem, "close keeps published elements");
+    check(!ring.receive(1), "receive reports the closed ring drained");
+    check(ring.receive(0) == published && !ring.receive(0),
+          "every subscriber drains the closed ring");
+  }
+
+  broadcast_ring<long long> ring(8, SUBSCRIBERS);
+  vector<long long> sums(SUBSCRIBERS, 0);
+  vector<thread> subscribers;
+  for (size_t sub = 0; sub < SUBSCRIBERS; ++sub)
+    subscribers.emplace_back([&ring, &sums, sub] {
+      auto add = [&sums, sub](const long long& elem) { sums[sub] += elem; };
+      while (ring.consume(sub, add, 4)) {
+      }
+    });
+  vector<thread> producers;
+  for (int producer = 0; producer < PRODUCERS; ++producer)
+    producers.emplace_back([&ring, producer] {
+      for (int i = 1; i <= ELEMS; ++i)
+        check(ring.publish(static_cast<long long>(producer) * ELEMS + i),
+              "publishes succeed while open");
+    });
+  for (auto& producer : producers) producer.join();
+  ring.close();
+  for (auto& subscriber : subscribers) subscriber.join();
+  const long long total = static_cast<long long>(PRODUCERS) * ELEMS;
+  for (size_t sub = 0; sub < SUBSCRIBERS; ++sub)
+    check(sums[sub] == total * (total + 1) / 2,
+          "every subscriber receives every element");
+}
+
+#if defined(BLOCKING_QUEUE_COROUTINES)
+detached_task pop_all(blocking_queue<int>& queue,
+                      coroutine_scheduler& scheduler, atomic<int>& popped,
+                      atomic<int>& finished) {
+  while (const auto elem = co_await queue.async_pop(scheduler)) ++popped;
+  ++finished;
+}
+
+detached_task push_all(blocking_queue<int>& queue,
+                       coroutine_scheduler& scheduler, int count,
+                       atomic<int>& pushed, atomic<int>& finished) {
+  for (int elem = 0; elem < count; ++elem) {
+    if (!co_await queue.async_push(elem, scheduler)) break;
+    ++pushed;
+  }
+  ++finished;
+}
+
+void check_coroutine_handoff() {
+  static constexpr int COROUTINES = 3;
+  static constexpr int THREADS = 2;
+  static constexpr int PUSHES = 2000;
+  // Long enough that only a stalled handoff exceeds it.
+  static constexpr milliseconds TIMEOUT(5000);
+  cout << "Checking coroutine handoff of blocking_queue..." << endl;
+  coroutine_scheduler scheduler;
+  {
+    // Coroutines only, resumed on this thread.
+    blocking_queue<int> queue(1);
+    atomic<int> pushed(0), popped(0), producers(0), consumers(0);
+    for (int i = 0; i < COROUTINES; ++i)
+      pop_all(queue, scheduler, popped, consumers);
+    for (int i = 0; i < COROUTINES; ++i)
+      push_all(queue, scheduler, PUSHES, pushed, producers);
+    while (scheduler.run_ready() > 0) {
+    }
+    check(producers == COROUTINES && pushed == COROUTINES * PUSHES,
+          "suspended pushes are resumed with space");
+    check(popped == pushed && consumers == 0,
+          "suspended pops are resumed with elements");
+
+    // The suspended pops take the first elements, the next one fills the
+    // queue and the last push is suspended when the queue is closed.
+    push_all(queue, scheduler, COROUTINES + 2, pushed, producers);
+    queue.close();
+    check(producers == COROUTINES, "close does not resume inline");
+    scheduler.run_ready();
+    check(producers == COROUTINES + 1 &&
+              pushed == COROUTINES * (PUSHES + 1) + 1,
+          "a push suspended at close fails");
+    check(popped == pushed && consumers == COROUTINES,
+          "pops drain the closed queue, then report it drained");
+    pop_all(queue, scheduler, popped, consumers);
+    check(consumers == COROUTINES + 1, "a pop after close does not suspend");
+  }
+
+  // Coroutines on the scheduler thread and blocked threads share a queue
+  // of one element, so every handoff between them must wake the other.
+  blocking_queue<int> queue(1);
+  atomic<int> pushed(0), popped(0), producers(0), consumers(0);
+  thread runner([&] { scheduler.run(); });
+  vector<thread> threads;
+  for (int i = 0; i < THREADS; ++i) {
+    threads.emplace_back([&] {
+      while (queue.pop()) ++popped;
+    });
+    threads.emplace_back([&] {
+      for (int elem = 0; elem < PUSHES && queue.push(elem); ++elem) ++pushed;
+    });
+  }
+  for (int i = 0; i < COROUTINES; ++i) {
+    pop_all(queue, scheduler, popped, consumers);
+    push_all(queue, scheduler, PUSHES, pushed, producers);
+  }
+  const int total = (COROUTINES + THREADS) * PUSHES;
+  const auto deadline = steady_clock::now() + TIMEOUT;
+  while (popped < total) {
+    check(steady_clock::now() < deadline, "no handoff stalls");
+    std::this_thread::sleep_for(milliseconds(1));
+  }
+  queue.close();
+  for (auto& worker : threads) worker.join();
+  scheduler.stop();
+  runner.join();
+  check(pushed == total && producers == COROUTINES,
+        "every push completes");
+  check(consumers == COROUTINES, "close ends every suspended pop");
+}
+#endif
+
+#if defined(__linux__)
+void check_eventfd_refill() {
+  static constexpr int CYCLES = 100;
+  static constexpr int PUSHES = 20000;
+  // Long enough that only a lost wakeup times out.
+  static constexpr int TIMEOUT_MS = 2000;
+  cout << "Checking drain and refill cycles of eventfd_listener..." << endl;
+  // Declared first so that it outlives the queue subscribed to it.
+  eventfd_listener listener;
+  blocking_queue<int> queue;
+  queue.subscribe(listener, 0);
+  pollfd desc{listener.fd(), POLLIN, 0};
+
+  for (int cycle = 0; cycle < CYCLES; ++cycle) {
+    queue.push(cycle);
+    check(::poll(&desc, 1, 0) == 1, "a refilled queue makes the fd readable");
+    check(listener.consume(), "consume reports the pending notification");
+    check(queue.try_pop() == cycle, "the drain finds the element");
+    check(::poll(&desc, 1, 0) == 0, "a drained queue leaves the fd unreadable");
+  }
+
+  // Notifications race with consume. Each must either make the descriptor
+  // readable again or come from a push the following drain finds.
+  thread producer([&] {
+    for (int elem = 0; elem < PUSHES; ++elem) {
+      queue.push(elem);
+      if (elem % 8 == 0) std::this_thread::yield();
+    }
+  });
+  int received = 0;
+  while (received < PUSHES) {
+    check(::poll(&desc, 1, TIMEOUT_MS) == 1, "no wakeup is lost");
+    listener.consume();
+    while (queue.try_pop()) ++received;
+  }
+  producer.join();
+  queue.unsubscribe(listener);
+}
+#endif
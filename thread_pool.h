@@ -0,0 +1,145 @@
+/*
+Fixed-size thread pool executor built on blocking_queue.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "blocking_queue.h"
+#include "segmented_queue.h"
+#include "task.h"
+
+/**
+ * Fixed set of worker threads that run tasks from a shared blocking_queue.
+ * Tasks are stored as task objects in segmented storage, so dispatching a
+ * closure of up to task::INLINE_SIZE bytes does not allocate once the
+ * queue has reached its working size. Tasks passed to post must not throw.
+ */
+class thread_pool {
+ private:
+  // Tasks waiting for a worker.
+  blocking_queue<task, block_wait, segmented_queue<task>> m_tasks;
+
+  std::vector<std::thread> m_workers;
+
+  // Makes the first shutdown join the workers while later ones wait.
+  std::once_flag m_shutdown;
+
+  /**
+   * Runs tasks until the queue is closed and drained.
+   */
+  void run();
+
+ public:
+  /**
+   * Starts the workers. If a worker cannot be started, the workers
+   * already running are joined before the exception propagates.
+   * @param num_threads The number of workers. Must be positive.
+   */
+  explicit thread_pool(
+      size_t num_threads = std::thread::hardware_concurrency());
+
+  /**
+   * Shuts down the pool, running every task already submitted.
+   */
+  ~thread_pool();
+
+  /**
+   * Prevent copying construction of thread pool.
+   */
+  thread_pool(const thread_pool&) = delete;
+
+  /**
+   * Prevent assignment of thread pool.
+   */
+  thread_pool& operator=(thread_pool) = delete;
+
+  /**
+   * Returns the number of workers.
+   * @returns The number of worker threads.
+   */
+  size_t size() const;
+
+  /**
+   * Schedules a callable without a way to observe its completion.
+   * @param fn The callable, invoked with no arguments.
+   * @returns Whether the callable was scheduled, false if shut down.
+   */
+  template <typename Function>
+  bool post(Function&& fn);
+
+  /**
+   * Schedules a callable and returns a future for its result. Allocates
+   * the future's shared state. If the pool is shut down, the callable is
+   * discarded and the future holds a std::future_error with
+   * std::future_errc::broken_promise.
+   * @param fn The callable, invoked with no arguments.
+   * @returns A future receiving the result or exception of fn.
+   */
+  template <typename Function>
+  std::future<std::invoke_result_t<std::decay_t<Function>&>> submit(
+      Function&& fn);
+
+  /**
+   * Stops accepting tasks, waits for every task already submitted to
+   * finish, and joins the workers. Must not be called by a worker.
+   * May be called by several threads at once, and every call returns
+   * only once the workers are joined.
+   */
+  void shutdown();
+};
+
+inline thread_pool::thread_pool(size_t num_threads) {
+  if (num_threads == 0)
+    throw std::invalid_argument("thread_pool needs a worker");
+  m_workers.reserve(num_threads);
+  try {
+    for (size_t idx = 0; idx < num_threads; ++idx)
+      m_workers.emplace_back(&thread_pool::run, this);
+  } catch (...) {
+    // Destroying a joinable thread would terminate the program.
+    shutdown();
+    throw;
+  }
+}
+
+inline thread_pool::~thread_pool() {
+  shutdown();
+}
+
+inline size_t thread_pool::size() const {
+  return m_workers.size();
+}
+
+inline void thread_pool::run() {
+  while (auto job = m_tasks.pop()) (*job)();
+}
+
+template <typename Function>
+bool thread_pool::post(Function&& fn) {
+  return m_tasks.push(task(std::forward<Function>(fn)));
+}
+
+template <typename Function>
+std::future<std::invoke_result_t<std::decay_t<Function>&>>
+thread_pool::submit(Function&& fn) {
+  using result = std::invoke_result_t<std::decay_t<Function>&>;
+  std::packaged_task<result()> job(std::forward<Function>(fn));
+  auto future = job.get_future();
+  m_tasks.push(task(std::move(job)));
+  return future;
+}
+
+inline void thread_pool::shutdown() {
+  std::call_once(m_shutdown, [this] {
+    m_tasks.close();
+    for (auto& worker : m_workers) worker.join();
+  });
+}
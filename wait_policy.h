@@ -0,0 +1,132 @@
+/*
+Wait policies choosing how blocking_queue threads wait for a condition.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "queue_util.h"
+
+/**
+ * Parks on the condition variable immediately.
+ * Lowest CPU usage, but every wakeup pays the scheduler's latency.
+ */
+struct block_wait {
+  /**
+   * Polls ready before the thread parks.
+   * @param lock The held lock on the state that ready approximates.
+   * @param ready Returns whether the thread may stop waiting. Must be
+   *              safe to call without the lock, which is held whenever
+   *              a true result is acted on.
+   * @param deadline The latest time to wait.
+   * @returns Whether ready became true. Parks the thread if false.
+   */
+  template <typename Predicate, typename Clock, typename Duration>
+  static bool spin(std::unique_lock<std::mutex>& lock, Predicate ready,
+                   const std::chrono::time_point<Clock, Duration>& deadline);
+};
+
+/**
+ * Spins with pause hints and exponential backoff, then yields the
+ * processor a few times, then parks on the condition variable.
+ * Catches handoffs that arrive within microseconds at cache-miss latency
+ * while still sleeping through long idle periods. Polls without the lock,
+ * taking it only once the condition looks true.
+ * @tparam SpinPolls The number of polls made while spinning.
+ * @tparam YieldPolls The number of polls made while yielding.
+ */
+template <unsigned SpinPolls = 16, unsigned YieldPolls = 4>
+struct spin_then_park_wait {
+  /**
+   * Polls ready before the thread parks.
+   * @param lock The held lock on the state that ready approximates.
+   * @param ready Returns whether the thread may stop waiting. Must be
+   *              safe to call without the lock, which is held whenever
+   *              a true result is acted on.
+   * @param deadline The latest time to wait.
+   * @returns Whether ready became true. Parks the thread if false.
+   */
+  template <typename Predicate, typename Clock, typename Duration>
+  static bool spin(std::unique_lock<std::mutex>& lock, Predicate ready,
+                   const std::chrono::time_point<Clock, Duration>& deadline);
+};
+
+/**
+ * Polls until the condition holds and never parks. Burns a core in
+ * exchange for the lowest wakeup latency. Threads using this policy are
+ * never signaled, so it suits dedicated cores only.
+ */
+struct busy_poll_wait {
+  /**
+   * Polls ready until it holds or the deadline passes.
+   * @param lock The held lock on the state that ready approximates.
+   * @param ready Returns whether the thread may stop waiting. Must be
+   *              safe to call without the lock, which is held whenever
+   *              a true result is acted on.
+   * @param deadline The latest time to wait.
+   * @returns Whether ready became true.
+   */
+  template <typename Predicate, typename Clock, typename Duration>
+  static bool spin(std::unique_lock<std::mutex>& lock, Predicate ready,
+                   const std::chrono::time_point<Clock, Duration>& deadline);
+};
+
+/**
+ * Largest number of pause hints issued between two polls.
+ */
+constexpr unsigned MAX_BACKOFF_PAUSES = 64;
+
+template <typename Predicate, typename Clock, typename Duration>
+bool block_wait::spin(std::unique_lock<std::mutex>&, Predicate ready,
+                      const std::chrono::time_point<Clock, Duration>&) {
+  return ready();
+}
+
+template <unsigned SpinPolls, unsigned YieldPolls>
+template <typename Predicate, typename Clock, typename Duration>
+bool spin_then_park_wait<SpinPolls, YieldPolls>::spin(
+    std::unique_lock<std::mutex>& lock, Predicate ready,
+    const std::chrono::time_point<Clock, Duration>& deadline) {
+  if (ready()) return true;
+  lock.unlock();
+  unsigned pauses = 1;
+  for (unsigned poll = 0; poll < SpinPolls + YieldPolls; ++poll) {
+    if (Clock::now() >= deadline) break;
+    if (poll < SpinPolls) {
+      for (unsigned i = 0; i < pauses; ++i) cpu_relax();
+      pauses = std::min(2 * pauses, MAX_BACKOFF_PAUSES);
+    } else {
+      std::this_thread::yield();
+    }
+    if (ready()) {
+      // Another thread may win the race for the lock, so recheck.
+      lock.lock();
+      if (ready()) return true;
+      lock.unlock();
+    }
+  }
+  lock.lock();
+  return ready();
+}
+
+template <typename Predicate, typename Clock, typename Duration>
+bool busy_poll_wait::spin(
+    std::unique_lock<std::mutex>& lock, Predicate ready,
+    const std::chrono::time_point<Clock, Duration>& deadline) {
+  while (!ready()) {
+    lock.unlock();
+    do {
+      if (Clock::now() >= deadline) {
+        lock.lock();
+        return ready();
+      }
+      cpu_relax();
+    } while (!ready());
+    lock.lock();
+  }
+  return true;
+}
@@ -0,0 +1,200 @@
+/*
+Lock-free work-stealing deque of Chase and Lev.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+#include "queue_util.h"
+
+/**
+ * Growable ring buffer deque with one owner thread and any number of
+ * thieves, after Chase and Lev with the memory orders of Le et al.
+ * The owner pushes and pops at the bottom without locks or, except when
+ * a single element remains, read-modify-write operations. Thieves take
+ * the oldest element from the top with one compare-and-swap.
+ * Elements are read while they may be concurrently overwritten, so T
+ * must be trivially copyable, such as a pointer to a task.
+ * @tparam T The element type.
+ */
+template <typename T>
+class work_stealing_deque {
+ private:
+  static_assert(std::is_trivially_copyable_v<T>,
+                "work_stealing_deque elements must be trivially copyable");
+
+  // Power-of-two circular array of slots indexed modulo its capacity.
+  struct ring {
+    const size_t mask;
+    std::unique_ptr<std::atomic<T>[]> slots;
+
+    explicit ring(size_t capacity)
+        : mask(capacity - 1), slots(new std::atomic<T>[capacity]) {}
+
+    std::atomic<T>& at(int64_t idx) {
+      return slots[static_cast<size_t>(idx) & mask];
+    }
+  };
+
+  // Index one past the newest element, written only by the owner.
+  alignas(CACHE_LINE) std::atomic<int64_t> m_bottom{0};
+
+  // Index of the oldest element, advanced by pop and steal.
+  alignas(CACHE_LINE) std::atomic<int64_t> m_top{0};
+
+  // Current ring, replaced by the owner when it grows.
+  alignas(CACHE_LINE) std::atomic<ring*> m_ring;
+
+  // Every ring ever used. Outgrown rings stay alive because a thief may
+  // still be reading from one. Only accessed by the owner.
+  std::vector<std::unique_ptr<ring>> m_rings;
+
+  /**
+   * Replaces the ring with one twice as large holding the same elements.
+   * Called by the owner only.
+   * @param old The current ring.
+   * @param bottom The current bottom index.
+   * @param top The current top index.
+   * @returns The new ring.
+   */
+  ring* grow(ring* old, int64_t bottom, int64_t top);
+
+ public:
+  /**
+   * Initializes empty deque.
+   * @param capacity The initial capacity, rounded up to a power of two.
+   *                 The deque grows as needed.
+   */
+  explicit work_stealing_deque(size_t capacity = 64);
+
+  /**
+   * Prevent copying construction of work stealing deque.
+   */
+  work_stealing_deque(const work_stealing_deque&) = delete;
+
+  /**
+   * Prevent assignment of work stealing deque.
+   */
+  work_stealing_deque& operator=(work_stealing_deque) = delete;
+
+  /**
+   * Determines whether the deque is empty
+   * at some non-deterministic time in the future.
+   * @returns The deque's emptiness status.
+   */
+  bool empty() const;
+
+  /**
+   * Determines the number of elements in the deque
+   * at some non-deterministic time in the future.
+   * @returns The size of the deque.
+   */
+  size_t size() const;
+
+  /**
+   * Pushes an element at the bottom. Called by the owner only.
+   * @param elem The item to enqueue.
+   */
+  void push(T elem);
+
+  /**
+   * Removes the newest element from the bottom. Called by the owner only.
+   * @returns The newest element, or nothing if the deque is empty.
+   */
+  std::optional<T> pop();
+
+  /**
+   * Removes the oldest element from the top. Called by any thread.
+   * @returns The oldest element, or nothing if the deque is empty or
+   *          another thread took the element first.
+   */
+  std::optional<T> steal();
+};
+
+template <typename T>
+typename work_stealing_deque<T>::ring* work_stealing_deque<T>::grow(
+    ring* old, int64_t bottom, int64_t top) {
+  auto bigger = std::make_unique<ring>(2 * (old->mask + 1));
+  for (auto idx = top; idx < bottom; ++idx)
+    bigger->at(idx).store(old->at(idx).load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+  auto* fresh = bigger.get();
+  m_rings.push_back(std::move(bigger));
+  m_ring.store(fresh, std::memory_order_release);
+  return fresh;
+}
+
+template <typename T>
+work_stealing_deque<T>::work_stealing_deque(size_t capacity) {
+  m_rings.push_back(std::make_unique<ring>(ring_capacity(capacity)));
+  m_ring.store(m_rings.back().get(), std::memory_order_relaxed);
+}
+
+template <typename T>
+bool work_stealing_deque<T>::empty() const {
+  return size() == 0;
+}
+
+template <typename T>
+size_t work_stealing_deque<T>::size() const {
+  const auto bottom = m_bottom.load(std::memory_order_relaxed);
+  const auto top = m_top.load(std::memory_order_relaxed);
+  return bottom > top ? static_cast<size_t>(bottom - top) : 0;
+}
+
+template <typename T>
+void work_stealing_deque<T>::push(T elem) {
+  const auto bottom = m_bottom.load(std::memory_order_relaxed);
+  const auto top = m_top.load(std::memory_order_acquire);
+  auto* slots = m_ring.load(std::memory_order_relaxed);
+  if (static_cast<size_t>(bottom - top) > slots->mask)
+    slots = grow(slots, bottom, top);
+  slots->at(bottom).store(elem, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  m_bottom.store(bottom + 1, std::memory_order_relaxed);
+}
+
+template <typename T>
+std::optional<T> work_stealing_deque<T>::pop() {
+  const auto bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+  auto* slots = m_ring.load(std::memory_order_relaxed);
+  m_bottom.store(bottom, std::memory_order_relaxed);
+  // Thieves must see the reservation before the owner reads top.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  auto top = m_top.load(std::memory_order_relaxed);
+  if (top > bottom) {
+    m_bottom.store(bottom + 1, std::memory_order_relaxed);
+    return std::nullopt;
+  }
+  std::optional<T> elem(slots->at(bottom).load(std::memory_order_relaxed));
+  if (top == bottom) {
+    // Last element, so race the thieves for it.
+    if (!m_top.compare_exchange_strong(top, top + 1,
+                                       std::memory_order_seq_cst,
+                                       std::memory_order_relaxed))
+      elem.reset();
+    m_bottom.store(bottom + 1, std::memory_order_relaxed);
+  }
+  return elem;
+}
+
+template <typename T>
+std::optional<T> work_stealing_deque<T>::steal() {
+  auto top = m_top.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const auto bottom = m_bottom.load(std::memory_order_acquire);
+  if (top >= bottom) return std::nullopt;
+  auto* slots = m_ring.load(std::memory_order_acquire);
+  const T elem = slots->at(top).load(std::memory_order_relaxed);
+  if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed))
+    return std::nullopt;
+  return elem;
+}
@@ -0,0 +1,205 @@
+/*
+Thread pool that balances fine-grained tasks by work stealing.
+
+Copyright 2021. Andrew Wang.
+*/
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "blocking_queue.h"
+#include "task.h"
+#include "work_stealing_deque.h"
+
+/**
+ * Fixed set of worker threads that each own a work_stealing_deque.
+ * Tasks submitted by a worker go to the bottom of its own deque, where it
+ * picks them up again in LIFO order while they are still in cache. Tasks
+ * submitted by other threads go to a shared injection queue. A worker
+ * with nothing to do steals the oldest task from another worker's deque,
+ * so workers only contend when one runs dry. Idle workers park on a
+ * shared condition variable only once there is nothing left to steal.
+ * Tasks must not throw.
+ */
+class work_stealing_pool {
+ private:
+  // Worker thread with its deque.
+  struct worker {
+    work_stealing_deque<task*> deque;
+    std::thread thread;
+  };
+
+  std::vector<std::unique_ptr<worker>> m_workers;
+
+  // Tasks submitted from outside the pool.
+  blocking_queue<task*> m_injector;
+
+  // Number of workers parked or about to park on m_wake.
+  std::atomic<size_t> m_idle{0};
+
+  // Number of tasks submitted but not yet finished.
+  std::atomic<size_t> m_pending{0};
+
+  // Whether the destructor has begun, written under m_mutex.
+  std::atomic<bool> m_stopping{false};
+
+  // Synchronization primitives for parking.
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+
+  // Pool and worker index of the calling thread, if it is a worker.
+  static inline thread_local work_stealing_pool* t_pool = nullptr;
+  static inline thread_local size_t t_index = 0;
+
+  /**
+   * Runs tasks on worker self until the pool stops and every submitted
+   * task has finished.
+   * @param self The index of the worker.
+   */
+  void run(size_t self);
+
+  /**
+   * Takes a task from the worker's own deque, then the injection queue,
+   * then the other workers' deques.
+   * @param self The index of the calling worker.
+   * @returns The task, or nullptr if none was found.
+   */
+  task* find_task(size_t self);
+
+  /**
+   * Determines whether any task is visible anywhere in the pool.
+   * @returns Whether a deque or the injection queue is non-empty.
+   */
+  bool has_work() const;
+
+ public:
+  /**
+   * Starts the workers.
+   * @param num_threads The number of workers. Must be positive.
+   */
+  explicit work_stealing_pool(
+      size_t num_threads = std::thread::hardware_concurrency());
+
+  /**
+   * Runs every submitted task, including those submitted by tasks during
+   * shutdown, then joins the workers.
+   */
+  ~work_stealing_pool();
+
+  /**
+   * Prevent copying construction of work stealing pool.
+   */
+  work_stealing_pool(const work_stealing_pool&) = delete;
+
+  /**
+   * Prevent assignment of work stealing pool.
+   */
+  work_stealing_pool& operator=(work_stealing_pool) = delete;
+
+  /**
+   * Returns the number of workers.
+   * @returns The number of worker threads.
+   */
+  size_t size() const;
+
+  /**
+   * Schedules a callable to run on some worker. Never blocks.
+   * @param fn The callable, invoked with no arguments.
+   */
+  template <typename Function>
+  void submit(Function&& fn);
+};
+
+inline work_stealing_pool::work_stealing_pool(size_t num_threads) {
+  if (num_threads == 0)
+    throw std::invalid_argument("work_stealing_pool needs a worker");
+  m_workers.reserve(num_threads);
+  for (size_t idx = 0; idx < num_threads; ++idx)
+    m_workers.push_back(std::make_unique<worker>());
+  for (size_t idx = 0; idx < num_threads; ++idx)
+    m_workers[idx]->thread = std::thread(&work_stealing_pool::run, this, idx);
+}
+
+inline work_stealing_pool::~work_stealing_pool() {
+  {
+    std::lock_guard lock(m_mutex);
+    m_stopping = true;
+  }
+  m_wake.notify_all();
+  for (auto& each : m_workers) each->thread.join();
+}
+
+inline size_t work_stealing_pool::size() const {
+  return m_workers.size();
+}
+
+inline void work_stealing_pool::run(size_t self) {
+  t_pool = this;
+  t_index = self;
+  while (true) {
+    if (auto* job = find_task(self)) {
+      (*job)();
+      delete job;
+      // The last task to finish during shutdown releases the workers.
+      if (m_pending.fetch_sub(1) == 1 && m_stopping.load()) {
+        { std::lock_guard lock(m_mutex); }
+        m_wake.notify_all();
+      }
+      continue;
+    }
+    std::unique_lock lock(m_mutex);
+    // Pairs with the fence in submit: either the submitter sees this
+    // worker as idle, or this worker sees the submitted task.
+    m_idle.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!has_work()) {
+      // A running task may still submit more, so wait for it to finish.
+      if (m_stopping.load() && m_pending.load() == 0) {
+        m_idle.fetch_sub(1, std::memory_order_relaxed);
+        return;
+      }
+      m_wake.wait(lock);
+    }
+    m_idle.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+inline task* work_stealing_pool::find_task(size_t self) {
+  if (auto job = m_workers[self]->deque.pop()) return *job;
+  if (auto job = m_injector.try_pop()) return *job;
+  // Start from a different victim on each worker to spread contention.
+  const auto count = m_workers.size();
+  for (size_t offset = 1; offset < count; ++offset)
+    if (auto job = m_workers[(self + offset) % count]->deque.steal())
+      return *job;
+  return nullptr;
+}
+
+inline bool work_stealing_pool::has_work() const {
+  if (!m_injector.empty()) return true;
+  for (const auto& each : m_workers)
+    if (!each->deque.empty()) return true;
+  return false;
+}
+
+template <typename Function>
+void work_stealing_pool::submit(Function&& fn) {
+  auto job = std::make_unique<task>(std::forward<Function>(fn));
+  m_pending.fetch_add(1, std::memory_order_relaxed);
+  if (t_pool == this)
+    m_workers[t_index]->deque.push(job.release());
+  else
+    m_injector.push(job.release());
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (m_idle.load(std::memory_order_relaxed) > 0) {
+    // A parking worker holds m_mutex from its last check until it waits.
+    { std::lock_guard lock(m_mutex); }
+    m_wake.notify_one();
+  }
+}